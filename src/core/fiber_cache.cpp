@@ -7,6 +7,7 @@
 
 #include "fiber_cache.h"
 #include "asio_post.h"
+#include "fiber_sched_algorithm.h"
 
 namespace petrel {
 
@@ -15,6 +16,22 @@ thread_local std::uint_fast32_t fiber_cache::m_fib_cnt = 0;
 thread_local bool fiber_cache::m_stop = false;
 
 void fiber_cache::run(std::function<void()>&& f) {
+    if (m_work_stealing) {
+        // count the fiber before it can be moved, so shutdown waits for it in any thread
+        ++m_stealing_cnt;
+        bf::fiber([this, f] {
+            // The fiber can only be moved to another thread before the handler starts. Handlers take thread local
+            // resources like lua states and bind I/O objects to the io_service of their thread, so they are pinned
+            // to the thread that runs them.
+            auto& props = boost::this_fiber::properties<fiber_props>();
+            props.migratable(true);
+            boost::this_fiber::yield();
+            props.migratable(false);
+            f();
+            --m_stealing_cnt;
+        }).detach();
+        return;
+    }
     auto fctx = get_fiber();
     if (likely(nullptr != fctx)) {
         fctx->func = f;
@@ -30,11 +47,13 @@ void fiber_cache::register_io_service(ba::io_service* iosvc) {
 }
 
 void fiber_cache::unregister_io_service(ba::io_service* iosvc) {
-    // wait for all active fiber contexts to return to the cache
+    // wait for all active fiber contexts to return to the cache and for the work stealing fibers to finish
     io_service_post_wait(iosvc, [] { m_stop = true; });
     bool no_active_fctx = false;
     do {
-        io_service_post_wait(iosvc, [&no_active_fctx] { no_active_fctx = m_fib_cnt == m_cache->size(); });
+        io_service_post_wait(iosvc, [this, &no_active_fctx] {
+            no_active_fctx = m_fib_cnt == m_cache->size() && 0 == m_stealing_cnt;
+        });
         if (!no_active_fctx) {
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
@@ -11,6 +11,7 @@
 #include <boost/asio.hpp>
 #include <boost/core/noncopyable.hpp>
 #include <boost/fiber/all.hpp>
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <vector>
@@ -29,7 +30,11 @@ class fiber_cache : boost::noncopyable {
     set_log_tag_default_priority("fiber_cache");
 
   public:
-    fiber_cache() {}
+    /// Ctor.
+    ///
+    /// @param work_stealing If true, fibers can be moved to another thread by the fiber_sched_algorithm before they
+    /// start to run the function. Fibers are not cached in this mode, as they can finish in another thread.
+    explicit fiber_cache(bool work_stealing = false) : m_work_stealing(work_stealing) {}
 
     /// Run a function in a fiber in the current thread context. If no free fiber is available a new one will be
     /// created.
@@ -41,7 +46,8 @@ class fiber_cache : boost::noncopyable {
     /// @param iosvc The io service object to register
     void register_io_service(ba::io_service* iosvc);
 
-    /// Unregister an io service object.
+    /// Unregister an io service object. Waits until the fibers of the io service and all fibers started in work
+    /// stealing mode have finished.
     ///
     /// @param iosvc The io service object to unregister
     void unregister_io_service(ba::io_service* iosvc);
@@ -82,6 +88,10 @@ class fiber_cache : boost::noncopyable {
         std::function<void()> func = nullptr;
     };
 
+    bool m_work_stealing;
+    /// The number of fibers started in work stealing mode that have not finished yet, they can run in any thread
+    std::atomic<std::size_t> m_stealing_cnt{0};
+
     using cache_type = std::vector<std::shared_ptr<fiber_context>>;
     thread_local static std::unique_ptr<cache_type> m_cache;
     thread_local static std::uint_fast32_t m_fib_cnt;
@@ -9,16 +9,12 @@
 
 namespace petrel {
 
-thread_local std::uint_fast64_t fiber_sched_algorithm::m_counter = 0;
-thread_local double fiber_sched_algorithm::m_rate_l = 1.0;
-thread_local double fiber_sched_algorithm::m_rate_xl = 1.0;
-thread_local std::chrono::nanoseconds fiber_sched_algorithm::m_expires = WAIT_INTERVAL_SHORT;
+boost::asio::io_service::id fiber_sched_algorithm::service::id;
 
-void fiber_sched_algorithm::update() {
-    m_counter++;
-    if (unlikely(m_expires != WAIT_INTERVAL_SHORT)) {
-        m_expires = WAIT_INTERVAL_SHORT;
-    }
-}
+constexpr std::size_t fiber_sched_algorithm::max_peers;
+thread_local boost::asio::io_service* fiber_sched_algorithm::m_current_iosvc = nullptr;
+std::array<fiber_sched_algorithm::peer, fiber_sched_algorithm::max_peers> fiber_sched_algorithm::m_peers;
+std::atomic<std::size_t> fiber_sched_algorithm::m_num_peers{0};
+std::mutex fiber_sched_algorithm::m_peers_mtx;
 
 }  // petrel
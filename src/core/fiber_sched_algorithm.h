@@ -10,15 +10,24 @@
 #ifndef FIBER_SCHED_ALGORITHM_H
 #define FIBER_SCHED_ALGORITHM_H
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
 
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/assert.hpp>
 #include <boost/config.hpp>
 
+#include <boost/fiber/algo/algorithm.hpp>
+#include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/context.hpp>
+#include <boost/fiber/mutex.hpp>
 #include <boost/fiber/operations.hpp>
+#include <boost/fiber/properties.hpp>
 #include <boost/fiber/scheduler.hpp>
 
 #include <petrel/fiber/yield.hpp>
@@ -30,86 +39,294 @@ namespace petrel {
 
 namespace bf = boost::fibers;
 
-auto constexpr WAIT_INTERVAL_SHORT = std::chrono::nanoseconds(100);
-auto constexpr WAIT_INTERVAL_LONG = std::chrono::milliseconds(1);
-auto constexpr WAIT_INTERVAL_EXTRALONG = std::chrono::milliseconds(30);
+/// Fiber properties used by the fiber_sched_algorithm
+class fiber_props : public bf::fiber_properties {
+  public:
+    explicit fiber_props(bf::context* ctx) : bf::fiber_properties(ctx) {}
 
-class fiber_sched_algorithm : public bf::algo::algorithm {
-  private:
-    boost::asio::io_service& m_iosvc;
-    boost::asio::steady_timer m_suspend_timer;
-    boost::asio::steady_timer m_keepalive_timer;
-    bf::scheduler::ready_queue_t m_ready_queue{};
+    /// Return true if the fiber can be moved to another thread.
+    bool migratable() const { return m_migratable; }
+
+    /// Allow a fiber to be moved to another thread by a work stealing scheduler. Only fibers that do not depend on
+    /// thread local state of the current thread should be marked as migratable.
+    void migratable(bool m) { m_migratable = m; }
 
-    thread_local static std::uint_fast64_t m_counter;
-    thread_local static double m_rate_l;
-    thread_local static double m_rate_xl;
-    thread_local static std::chrono::nanoseconds m_expires;
+  private:
+    bool m_migratable = false;
+};
 
+/// Scheduling algorithm that integrates fibers with an io_service. The io_service gets driven by a loop running in
+/// the main fiber: As long as other fibers are ready, pending handlers get polled and the loop yields to the fibers.
+/// If no fiber is ready, the thread blocks in io_service::run_one() until a handler becomes ready or notify() gets
+/// called from another thread.
+///
+/// With work stealing enabled, a thread that runs out of work marks itself as idle. Ready fibers that have been
+/// marked as migratable are handed to an idle thread via the steal queue of the current thread, all other fibers and
+/// all fibers of threads without idle peers stay in the local ready queue. The peer slots are never freed, so threads
+/// look at each other without a global lock.
+class fiber_sched_algorithm : public bf::algo::algorithm_with_properties<fiber_props> {
   public:
-    explicit fiber_sched_algorithm(boost::asio::io_service& iosvc)
-        : m_iosvc(iosvc), m_suspend_timer(iosvc), m_keepalive_timer(iosvc) {
-        on_empty_io_service();
+    /// The service keeps the io_service busy, so run_one() blocks instead of returning when no work is pending.
+    struct service : public boost::asio::io_service::service {
+        static boost::asio::io_service::id id;
+
+        explicit service(boost::asio::io_service& iosvc)
+            : boost::asio::io_service::service(iosvc), m_work(new boost::asio::io_service::work(iosvc)) {}
+        virtual ~service() {}
+
+        service(const service&) = delete;
+        service& operator=(const service&) = delete;
+
+        void shutdown_service() override final { m_work.reset(); }
+
+      private:
+        std::unique_ptr<boost::asio::io_service::work> m_work;
+    };
+
+    /// Max number of threads that can take part in work stealing at a time
+    static constexpr std::size_t max_peers = 256;
+
+    explicit fiber_sched_algorithm(boost::asio::io_service& iosvc, bool work_stealing = false)
+        : m_iosvc(iosvc), m_suspend_timer(iosvc), m_work_stealing(work_stealing) {
+        if (!boost::asio::has_service<service>(m_iosvc)) {
+            boost::asio::add_service(m_iosvc, new service(m_iosvc));
+        }
+        m_current_iosvc = &m_iosvc;
+        if (m_work_stealing) {
+            m_peer = register_peer();
+            // all slots taken, this thread runs its fibers alone
+            m_work_stealing = nullptr != m_peer;
+        }
+        m_iosvc.post([this] {
+            while (!m_iosvc.stopped()) {
+                if (has_ready_fibers()) {
+                    // run all pending handlers
+                    while (m_iosvc.poll()) {
+                    }
+                    // block this fiber until all ready fibers have been processed, suspend_until() will wake us up
+                    std::unique_lock<bf::mutex> lock(m_mtx);
+                    m_cv.wait(lock);
+                } else {
+                    // run one handler, if no handler is available block the thread, peers can hand us fibers
+                    // meanwhile
+                    set_idle(true);
+                    auto handled = m_iosvc.run_one();
+                    set_idle(false);
+                    if (!handled) {
+                        break;
+                    }
+                }
+            }
+        });
+    }
+
+    ~fiber_sched_algorithm() {
+        if (nullptr != m_peer) {
+            std::lock_guard<std::mutex> lock(m_peer->mtx);
+            m_peer->algo = nullptr;
+            m_peer->idle.store(false, std::memory_order_release);
+        }
+        m_current_iosvc = nullptr;
     }
 
-    void awakened(bf::context* ctx) noexcept {
+    /// Return the io_service of the scheduler of the current thread or nullptr
+    static boost::asio::io_service* current_io_service() { return m_current_iosvc; }
+
+    void awakened(bf::context* ctx, fiber_props& props) noexcept {
         BOOST_ASSERT(nullptr != ctx);
+        BOOST_ASSERT(!ctx->ready_is_linked());
+        if (m_work_stealing && props.migratable() && !ctx->is_context(bf::type::pinned_context)) {
+            auto* idle = find_idle_peer();
+            if (nullptr != idle) {
+                // detach the fiber from this thread, so the idle thread can pick it up
+                ctx->detach();
+                {
+                    std::lock_guard<std::mutex> lock(m_peer->mtx);
+                    m_peer->queue.push_back(ctx);
+                }
+                m_peer->size.fetch_add(1, std::memory_order_release);
+                wake_peer(*idle);
+                return;
+            }
+        }
         ctx->ready_link(m_ready_queue);
+        if (!ctx->is_context(bf::type::dispatcher_context)) {
+            ++m_counter;
+        }
     }
 
     bf::context* pick_next() noexcept {
         bf::context* ctx(nullptr);
+        if (unlikely(m_work_stealing && m_peer->requested.exchange(false, std::memory_order_acq_rel))) {
+            // a peer has queued a fiber for us
+            ctx = steal_from_peer();
+            if (nullptr != ctx) {
+                return ctx;
+            }
+        }
         if (!m_ready_queue.empty()) {
             ctx = &m_ready_queue.front();
             m_ready_queue.pop_front();
             BOOST_ASSERT(nullptr != ctx);
             BOOST_ASSERT(bf::context::active() != ctx);
+            if (!ctx->is_context(bf::type::dispatcher_context)) {
+                --m_counter;
+            }
+            return ctx;
+        }
+        if (m_work_stealing) {
+            // fibers we have queued for a peer that has not taken them yet
+            ctx = steal();
+            if (nullptr != ctx) {
+                bf::context::active()->attach(ctx);
+            } else {
+                ctx = steal_from_peer();
+            }
         }
         return ctx;
     }
 
-    bool has_ready_fibers() const noexcept { return !m_ready_queue.empty(); }
+    bool has_ready_fibers() const noexcept {
+        return 0 < m_counter || (m_work_stealing && 0 < m_peer->size.load(std::memory_order_acquire));
+    }
 
     void suspend_until(std::chrono::steady_clock::time_point const& suspend_time) noexcept {
-        if (m_suspend_timer.expires_at() != suspend_time) {
+        if ((std::chrono::steady_clock::time_point::max)() != suspend_time) {
             m_suspend_timer.expires_at(suspend_time);
-            m_suspend_timer.async_wait([](boost::system::error_code const&) {});
+            m_suspend_timer.async_wait([](boost::system::error_code const&) { boost::this_fiber::yield(); });
         }
+        // all ready fibers have been processed, wake up the io_service loop
+        m_cv.notify_one();
     }
 
-    void notify() noexcept { m_suspend_timer.expires_at(std::chrono::steady_clock::now()); }
+    void notify() noexcept {
+        // Called from another thread: Cancel the timer, so the io_service loop returns from run_one() and the
+        // scheduler gets a chance to run the fibers that became ready.
+        m_suspend_timer.async_wait([](boost::system::error_code const&) { boost::this_fiber::yield(); });
+        m_suspend_timer.expires_at(std::chrono::steady_clock::now());
+    }
+
+  private:
+    /// The work stealing state of a thread
+    struct peer {
+        /// Guards queue and algo
+        std::mutex mtx;
+        /// Migratable fibers that have been detached for an idle peer
+        std::deque<bf::context*> queue;
+        std::atomic<std::size_t> size{0};
+        /// The thread has no ready fibers and waits for handlers
+        std::atomic_bool idle{false};
+        /// A peer has queued a fiber for this thread
+        std::atomic_bool requested{false};
+        /// The owner of the slot or nullptr if the slot is free
+        fiber_sched_algorithm* algo = nullptr;
+    };
+
+    boost::asio::io_service& m_iosvc;
+    boost::asio::steady_timer m_suspend_timer;
+    bf::scheduler::ready_queue_t m_ready_queue{};
+    bf::mutex m_mtx;
+    bf::condition_variable m_cv;
+    std::size_t m_counter = 0;
+
+    static thread_local boost::asio::io_service* m_current_iosvc;
 
-    void on_empty_io_service() {
-        m_iosvc.post([]() { boost::this_fiber::yield(); });
+    // work stealing
+    bool m_work_stealing;
+    peer* m_peer = nullptr;
+    std::size_t m_next_peer = 0;
 
-        m_rate_l = m_rate_l * 0.99999 - 0.0001 + m_counter;
-        m_rate_xl = m_rate_xl * 0.99999 - 0.00009 + m_counter;
-        m_counter = 0;
+    /// The slots are only added under m_peers_mtx, m_num_peers slots can be read without locking
+    static std::array<peer, max_peers> m_peers;
+    static std::atomic<std::size_t> m_num_peers;
+    static std::mutex m_peers_mtx;
 
-        if (m_rate_l < 0.0) {
-            m_rate_l = 0.0;
+    /// Claim a free peer slot, returns nullptr if all slots are taken
+    peer* register_peer() {
+        std::lock_guard<std::mutex> lock(m_peers_mtx);
+        auto num_peers = m_num_peers.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < num_peers; ++i) {
+            std::lock_guard<std::mutex> peer_lock(m_peers[i].mtx);
+            if (nullptr == m_peers[i].algo) {
+                m_peers[i].algo = this;
+                return &m_peers[i];
+            }
         }
-        if (m_rate_xl < 0.0) {
-            m_rate_xl = 0.0;
+        if (num_peers == max_peers) {
+            return nullptr;
         }
+        m_peers[num_peers].algo = this;
+        m_num_peers.store(num_peers + 1, std::memory_order_release);
+        return &m_peers[num_peers];
+    }
 
-        if (unlikely(m_rate_xl == 0.0)) {
-            if (unlikely(m_expires != WAIT_INTERVAL_EXTRALONG)) {
-                m_expires = WAIT_INTERVAL_EXTRALONG;
-            }
-        } else if (unlikely(m_rate_l == 0.0)) {
-            if (unlikely(m_expires != WAIT_INTERVAL_LONG)) {
-                m_expires = WAIT_INTERVAL_LONG;
+    void set_idle(bool idle) noexcept {
+        if (m_work_stealing) {
+            m_peer->idle.store(idle, std::memory_order_release);
+        }
+    }
+
+    /// Return an idle peer and clear its idle flag, so it does not get several fibers at once
+    peer* find_idle_peer() noexcept {
+        auto num_peers = m_num_peers.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < num_peers; ++i) {
+            auto& p = m_peers[(m_next_peer + i) % num_peers];
+            if (&p != m_peer && p.idle.load(std::memory_order_acquire) &&
+                p.idle.exchange(false, std::memory_order_acq_rel)) {
+                m_next_peer += i + 1;
+                return &p;
             }
-        } else if (unlikely(m_expires != WAIT_INTERVAL_SHORT)) {
-            m_expires = WAIT_INTERVAL_SHORT;
         }
+        return nullptr;
+    }
 
-        m_keepalive_timer.expires_from_now(m_expires);
-        m_keepalive_timer.async_wait(std::bind(&fiber_sched_algorithm::on_empty_io_service, this));
+    /// Take a fiber from the front of our own steal queue. The fiber is detached and has to be attached by the caller.
+    bf::context* steal() noexcept {
+        if (0 == m_peer->size.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(m_peer->mtx);
+        if (m_peer->queue.empty()) {
+            return nullptr;
+        }
+        auto* ctx = m_peer->queue.front();
+        m_peer->queue.pop_front();
+        m_peer->size.fetch_sub(1, std::memory_order_release);
+        return ctx;
+    }
+
+    /// Take a fiber from the back of another threads steal queue and attach it to this thread.
+    bf::context* steal_from_peer() noexcept {
+        bf::context* ctx(nullptr);
+        auto num_peers = m_num_peers.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < num_peers && nullptr == ctx; ++i) {
+            auto& p = m_peers[(m_next_peer + i) % num_peers];
+            if (&p == m_peer || 0 == p.size.load(std::memory_order_acquire)) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(p.mtx);
+            if (!p.queue.empty()) {
+                ctx = p.queue.back();
+                p.queue.pop_back();
+                p.size.fetch_sub(1, std::memory_order_release);
+            }
+        }
+        if (nullptr != ctx) {
+            bf::context::active()->attach(ctx);
+        }
+        return ctx;
     }
 
-    static void update();
+    /// Wake up an idle peer to take the fibers we have queued
+    static void wake_peer(peer& p) noexcept {
+        if (!p.requested.exchange(true, std::memory_order_acq_rel)) {
+            std::lock_guard<std::mutex> lock(p.mtx);
+            if (nullptr != p.algo) {
+                // io_service::post is thread safe, the handler makes the main fiber yield to the scheduler
+                p.algo->m_iosvc.post([] { boost::this_fiber::yield(); });
+            }
+        }
+    }
 };
 
 }  // petrel
@@ -10,9 +10,25 @@
 #include "branch.h"
 #include "make_unique.h"
 
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/assert.hpp>
 #include <boost/filesystem.hpp>
+#include <cerrno>
 #include <chrono>
-#include <fstream>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 using namespace boost::filesystem;
 
@@ -20,69 +36,198 @@ namespace petrel {
 
 thread_local std::unique_ptr<file_cache::file_map_type> file_cache::m_file_map_local;
 
-file_cache::file::file(const std::string& name, bool read_from_disk) {
-    path p(name);
-    if (exists(p)) {
-        if (is_regular_file(p)) {
+/// Files smaller than this are not compressed
+constexpr std::size_t min_compress_size = 256;
+
+file_cache::file::file(const std::string& name, bool read_from_disk, std::size_t max_mapped_size) : m_name(name) {
+    if (!read_from_disk) {
+        path p(name);
+        if (!exists(p)) {
+            log_err(name << " does not exists");
+        } else if (!is_regular_file(p)) {
+            log_err(name << " is no file");
+        } else {
             m_size = file_size(p);
             m_time = last_write_time(p);
-            if (read_from_disk) {
-                std::ifstream is(name, std::ifstream::binary);
-                if (is) {
-                    m_data.reserve(m_size);
-                    std::copy(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>(),
-                              std::back_inserter(m_data));
-                    m_good = true;
-                } else {
-                    log_err("can't open file " << name);
-                }
-            }
+        }
+        return;
+    }
+    m_fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0) {
+        log_err("can't open file " << name << ": " << std::strerror(errno));
+        return;
+    }
+    // The size and the time have to be taken from the open file, the file might have been replaced or truncated
+    // since it has been found. Mapping more than the file size would fault on access.
+    struct stat st;
+    if (::fstat(m_fd, &st) < 0) {
+        log_err("can't stat file " << name << ": " << std::strerror(errno));
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        log_err(name << " is no file");
+        return;
+    }
+    m_size = st.st_size;
+    m_time = st.st_mtime;
+    if (m_size > max_mapped_size) {
+        m_streamed = true;
+        m_good = true;
+    } else if (m_size > 0) {
+        auto* addr = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (MAP_FAILED == addr) {
+            log_err("can't map file " << name << ": " << std::strerror(errno));
         } else {
-            log_err(name << " is no file");
+            m_data = reinterpret_cast<const char*>(addr);
+            m_good = true;
         }
     } else {
-        log_err(name << " does not exists");
+        m_good = true;
+    }
+    if (m_good) {
+        init_validators();
+    }
+}
+
+file_cache::file::file(std::vector<char> buf, std::time_t time)
+    : m_size(buf.size()), m_time(time), m_good(true), m_buffer(std::move(buf)) {
+    m_data = m_buffer.data();
+    init_validators();
+}
+
+/// Return true if the file name has an extension of a file type that compresses well
+bool compressible(const std::string& name) {
+    static const std::vector<std::string> exts = {".html", ".htm", ".css", ".js",  ".mjs", ".json",
+                                                  ".map",  ".svg", ".xml", ".txt", ".csv", ".wasm"};
+    for (auto& ext : exts) {
+        if (boost::algorithm::iends_with(name, ext)) {
+            return true;
+        }
     }
+    return false;
 }
 
-file_cache::file_cache(int refresh_time) {
+/// Compress a buffer with gzip, returns an empty buffer on errors
+std::vector<char> gzip_compress(boost::string_ref data) {
+    std::vector<char> out;
+    z_stream zs{};
+    // 16 + max window bits selects the gzip format
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return out;
+    }
+    out.resize(deflateBound(&zs, data.size()));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef*>(out.data());
+    zs.avail_out = out.size();
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+        out.resize(zs.total_out);
+    } else {
+        out.clear();
+    }
+    deflateEnd(&zs);
+    return out;
+}
+
+void file_cache::file::load_variants() {
+    if (!m_good || m_name.empty()) {
+        return;
+    }
+    // precompressed files, they are streamed if the original file is
+    std::size_t max_mapped_size = m_streamed ? 0 : std::numeric_limits<std::size_t>::max();
+    auto br = m_name + ".br";
+    if (exists(path(br))) {
+        auto f = std::make_shared<file>(br, true, max_mapped_size);
+        if (f->good()) {
+            m_variants[static_cast<int>(encoding::br)] = f;
+        }
+    }
+    auto gz = m_name + ".gz";
+    if (exists(path(gz))) {
+        auto f = std::make_shared<file>(gz, true, max_mapped_size);
+        if (f->good()) {
+            m_variants[static_cast<int>(encoding::gzip)] = f;
+        }
+    } else if (!m_streamed && m_size >= min_compress_size && compressible(m_name)) {
+        auto buf = gzip_compress(data());
+        // keep the variant only if it saves something
+        if (!buf.empty() && buf.size() < m_size - m_size / 10) {
+            log_debug("compressed " << m_name << " from " << m_size << " to " << buf.size() << " bytes");
+            m_variants[static_cast<int>(encoding::gzip)] = std::make_shared<file>(std::move(buf), m_time);
+        }
+    }
+}
+
+void file_cache::file::init_validators() {
+    char buf[64];
+    int len;
+    if (m_streamed) {
+        // reading the whole file would defeat streaming it
+        len = std::snprintf(buf, sizeof(buf), "\"%zx-%" PRIx64 "\"", m_size, static_cast<std::uint64_t>(m_time));
+    } else {
+        // FNV-1a over the content, so the tag does not change if a file gets touched only
+        std::uint64_t hash = UINT64_C(14695981039346656037);
+        for (std::size_t i = 0; i < m_size; ++i) {
+            hash ^= static_cast<unsigned char>(m_data[i]);
+            hash *= UINT64_C(1099511628211);
+        }
+        len = std::snprintf(buf, sizeof(buf), "\"%zx-%016" PRIx64 "\"", m_size, hash);
+    }
+    m_etag.assign(buf, len);
+    m_last_modified = to_http_date(m_time);
+}
+
+std::size_t file_cache::file::memory() const {
+    std::size_t bytes = m_streamed ? 0 : m_size;
+    for (auto& v : m_variants) {
+        if (nullptr != v) {
+            bytes += v->memory();
+        }
+    }
+    return bytes;
+}
+
+file_cache::file::~file() {
+    // in memory files have no descriptor
+    if (nullptr != m_data && m_fd >= 0) {
+        ::munmap(const_cast<char*>(m_data), m_size);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+std::string file_cache::to_http_date(std::time_t t) {
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    char buf[64];
+    auto len = std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buf, len);
+}
+
+std::time_t file_cache::from_http_date(const std::string& s) {
+    std::tm tm{};
+    auto* end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (nullptr == end) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+file_cache::file_cache(int refresh_time, std::size_t cache_size, std::size_t stream_threshold)
+    : m_clock_hand(m_clock.end()), m_cache_size(cache_size), m_stream_threshold(stream_threshold) {
+#ifdef __linux__
+    m_inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0) {
+        log_warn("inotify not available (" << std::strerror(errno) << "), polling for changes every " << refresh_time
+                                           << " seconds");
+    }
+#endif
     m_thread = std::thread([this, refresh_time] {
-        while (!m_stop) {
-            // relax
-            std::this_thread::sleep_for(std::chrono::seconds(refresh_time));
-            // look for new objects
-            std::unordered_set<std::string> dirs;
-            {
-                std::lock_guard<std::mutex> lock(m_dir_mtx);
-                dirs = m_directories;
-            }
-            for (auto& dir : dirs) {
-                scan_directory(dir);
-            }
-            // update/remove existing objects
-            std::vector<std::string> to_remove;
-            std::vector<std::string> to_add;
-            {
-                std::lock_guard<std::mutex> lock(m_file_mtx);
-                for (auto& pair : m_file_map) {
-                    path p(pair.first);
-                    if (exists(p)) {
-                        if (*pair.second != file(pair.first)) {
-                            // changed file
-                            to_add.push_back(pair.first);
-                        }
-                    } else {
-                        // file does not exists, remove it
-                        to_remove.push_back(pair.first);
-                    }
-                }
-            }
-            for (auto& f : to_add) {
-                add_file(f);
-            }
-            for (auto& f : to_remove) {
-                remove_file(f);
-            }
+        if (m_inotify_fd >= 0) {
+            watch_files();
+        } else {
+            poll_files(refresh_time);
         }
     });
 }
@@ -90,6 +235,157 @@ file_cache::file_cache(int refresh_time) {
 file_cache::~file_cache() {
     m_stop = true;
     m_thread.join();
+    if (m_inotify_fd >= 0) {
+        ::close(m_inotify_fd);
+    }
+}
+
+void file_cache::poll_files(int refresh_time) {
+    while (!m_stop) {
+        // relax
+        std::this_thread::sleep_for(std::chrono::seconds(refresh_time));
+        refresh_all();
+    }
+}
+
+void file_cache::refresh_all() {
+    // look for new objects
+    std::unordered_set<std::string> dirs;
+    {
+        std::lock_guard<std::mutex> lock(m_dir_mtx);
+        dirs = m_directories;
+    }
+    for (auto& dir : dirs) {
+        scan_directory(dir);
+    }
+    // update/remove existing objects, we do not hold the lock while accessing the file system
+    std::unordered_set<std::string> names;
+    std::unordered_map<std::string, std::shared_ptr<file>> files;
+    {
+        std::lock_guard<std::mutex> lock(m_file_mtx);
+        names = m_known_files;
+        for (auto& pair : m_file_map) {
+            files[pair.first] = pair.second.ptr;
+        }
+    }
+    for (auto& name : names) {
+        path p(name);
+        if (exists(p)) {
+            auto it = files.find(name);
+            if (files.end() != it && *it->second != file(name)) {
+                // changed file
+                add_file(name);
+            }
+        } else {
+            // file does not exists, remove it
+            remove_file(name);
+        }
+    }
+}
+
+void file_cache::watch_files() {
+#ifdef __linux__
+    alignas(inotify_event) char buf[16 * 1024];
+    pollfd pfd{m_inotify_fd, POLLIN, 0};
+    while (!m_stop) {
+        // wake up from time to time to check if we should stop
+        auto ret = ::poll(&pfd, 1, 500);
+        if (ret <= 0) {
+            continue;
+        }
+        ssize_t len;
+        while ((len = ::read(m_inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char* p = buf; p < buf + len;) {
+                auto* ev = reinterpret_cast<inotify_event*>(p);
+                handle_event(ev->wd, ev->mask, ev->len > 0 ? ev->name : "");
+                p += sizeof(inotify_event) + ev->len;
+            }
+        }
+    }
+#endif
+}
+
+void file_cache::handle_event(int wd, std::uint32_t mask, const std::string& name) {
+#ifdef __linux__
+    if (mask & IN_Q_OVERFLOW) {
+        // we lost events, check everything
+        log_warn("inotify queue overflow, rescanning all directories");
+        refresh_all();
+        return;
+    }
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(m_dir_mtx);
+        auto it = m_watches.find(wd);
+        if (m_watches.end() == it) {
+            return;
+        }
+        if (mask & IN_IGNORED) {
+            // the directory has been removed
+            m_watches.erase(it);
+            return;
+        }
+        dir = it->second;
+    }
+    if (name.empty()) {
+        return;
+    }
+    auto full_name = dir;
+    if (full_name.back() != '/') {
+        full_name += '/';
+    }
+    full_name += name;
+    if (mask & IN_ISDIR) {
+        if (mask & (IN_CREATE | IN_MOVED_TO)) {
+            scan_directory(full_name);
+        } else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+            remove_directory_files(full_name);
+        }
+    } else if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        // a new or modified file
+        add_file(full_name);
+    } else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+        remove_file(full_name);
+    }
+#else
+    (void)wd;
+    (void)mask;
+    (void)name;
+#endif
+}
+
+void file_cache::add_watch(const std::string& name) {
+#ifdef __linux__
+    if (m_inotify_fd < 0) {
+        return;
+    }
+    auto wd = ::inotify_add_watch(m_inotify_fd, name.c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                                                  IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        log_err("can't watch directory " << name << ": " << std::strerror(errno));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_dir_mtx);
+    m_watches[wd] = name;
+#else
+    (void)name;
+#endif
+}
+
+void file_cache::remove_directory_files(const std::string& name) {
+    auto prefix = name + "/";
+    std::vector<std::string> to_remove;
+    {
+        std::lock_guard<std::mutex> lock(m_file_mtx);
+        for (auto& name : m_known_files) {
+            if (name.compare(0, prefix.size(), prefix) == 0) {
+                to_remove.push_back(name);
+            }
+        }
+    }
+    for (auto& f : to_remove) {
+        remove_file(f);
+    }
 }
 
 void file_cache::register_io_service(ba::io_service* iosvc) {
@@ -110,15 +406,13 @@ void file_cache::unregister_io_service(ba::io_service* iosvc) {
 bool file_cache::scan_directory(const std::string& name) {
     path p(name);
     if (exists(p) && is_directory(p)) {
+        add_watch(name);
         for (directory_entry& entry : directory_iterator(p)) {
             if (is_directory(entry.status())) {
                 scan_directory(entry.path().string());
-            } else {
-                std::shared_ptr<file> f = get_file_main(entry.path().string());
-                if (nullptr == f) {
-                    // new file
-                    add_file(entry.path().string());
-                }
+            } else if (!known_file(entry.path().string())) {
+                // new file
+                add_file(entry.path().string());
             }
         }
         return true;
@@ -139,66 +433,175 @@ bool file_cache::add_directory(const std::string& name) {
 }
 
 bool file_cache::add_file(const std::string& name) {
-    auto f = std::make_shared<file>(name, true);
-    log_debug("loaded object " << name << " (" << f->size() << " bytes)");
-    if (f->good()) {
-        // update the local caches
-        for (auto* iosvc : m_iosvcs) {
-            iosvc->post([this, name, f] { (*m_file_map_local)[name] = f; });
-        }
-        // update the main map
+    if (boost::algorithm::ends_with(name, ".gz") || boost::algorithm::ends_with(name, ".br")) {
+        // a precompressed variant, reload the original file
+        add_file(name.substr(0, name.size() - 3));
+    }
+    if (!is_regular_file(path(name))) {
+        return false;
+    }
+    std::lock_guard<std::mutex> load_lock(m_load_mtx);
+    {
         std::lock_guard<std::mutex> lock(m_file_mtx);
-        m_file_map[name] = f;
-        return true;
+        m_known_files.insert(name);
+        if (m_file_map.end() == m_file_map.find(name)) {
+            // loaded on the first request
+            return true;
+        }
     }
-    return false;
+    return nullptr != load(name);
 }
 
 void file_cache::remove_file(const std::string& name) {
     log_debug("removing object " << name);
-    // update the local caches
-    for (auto* iosvc : m_iosvcs) {
-        iosvc->post([name] {
-            auto it = m_file_map_local->find(name);
-            if (m_file_map_local->end() != it) {
-                m_file_map_local->erase(it);
-            }
-        });
+    if (boost::algorithm::ends_with(name, ".gz") || boost::algorithm::ends_with(name, ".br")) {
+        // a precompressed variant, reload the original file
+        add_file(name.substr(0, name.size() - 3));
     }
-    // update the main map
     std::lock_guard<std::mutex> lock(m_file_mtx);
-    auto it = m_file_map.find(name);
-    if (m_file_map.end() != it) {
-        m_file_map.erase(it);
-    }
+    m_known_files.erase(name);
+    drop(name);
 }
 
-std::shared_ptr<file_cache::file> file_cache::get_file(const std::string& name) {
+std::shared_ptr<file_cache::file> file_cache::get_file(boost::string_ref dir, boost::string_ref rel) {
     // thread local lookup
     bool update_local_map = false;
     if (likely(nullptr != m_file_map_local)) {
-        auto it = m_file_map_local->find(name);
+        auto it = m_file_map_local->find(name_ref{dir, rel});
         if (m_file_map_local->end() != it) {
-            return it->second;
+            auto& f = it->second;
+            // avoid writing to the shared cache line if the bit is set already
+            if (!f->m_referenced.load(std::memory_order_relaxed)) {
+                f->m_referenced.store(true, std::memory_order_relaxed);
+            }
+            return f;
         }
         update_local_map = true;
     }
-    // falling back to main map
+    // falling back to main map, the name is built in a buffer of the thread, so a miss (e.g. a 404) does not
+    // allocate either
+    thread_local std::string name;
+    name.assign(dir.data(), dir.size());
+    name.append(rel.data(), rel.size());
     auto file = get_file_main(name);
+    if (nullptr == file) {
+        file = load_file(name);
+    }
     if (nullptr != file && update_local_map) {
         // update the local cache
-        (*m_file_map_local)[name] = file;
+        set_local(file);
     }
     return file;
 }
 
+void file_cache::set_local(const std::shared_ptr<file>& f) {
+    // the key references the name of the file, so an old entry has to go
+    name_ref key{f->name(), boost::string_ref()};
+    m_file_map_local->erase(key);
+    m_file_map_local->emplace(key, f);
+}
+
 std::shared_ptr<file_cache::file> file_cache::get_file_main(const std::string& name) {
     std::lock_guard<std::mutex> lock(m_file_mtx);
     auto it = m_file_map.find(name);
     if (m_file_map.end() != it) {
-        return it->second;
+        it->second.ptr->m_referenced.store(true, std::memory_order_relaxed);
+        return it->second.ptr;
     }
     return nullptr;
 }
 
+std::size_t file_cache::cached_bytes() {
+    std::lock_guard<std::mutex> lock(m_file_mtx);
+    return m_cached_bytes;
+}
+
+bool file_cache::known_file(const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_file_mtx);
+    return m_known_files.count(name) > 0;
+}
+
+std::shared_ptr<file_cache::file> file_cache::load_file(const std::string& name) {
+    if (!known_file(name)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> load_lock(m_load_mtx);
+    // another thread might have loaded the file in the meantime
+    auto f = get_file_main(name);
+    if (nullptr == f) {
+        f = load(name);
+    }
+    return f;
+}
+
+std::shared_ptr<file_cache::file> file_cache::load(const std::string& name) {
+    auto f = std::make_shared<file>(name, true, m_stream_threshold);
+    if (!f->good()) {
+        return nullptr;
+    }
+    f->load_variants();
+    std::lock_guard<std::mutex> lock(m_file_mtx);
+    // streamed files are kept too, so their descriptor, validators and variants are not looked up for each request
+    log_debug((f->streamed() ? "streaming object " : "loaded object ") << name << " (" << f->size() << " bytes)");
+    // update the local caches
+    for (auto* iosvc : m_iosvcs) {
+        iosvc->post([f] { set_local(f); });
+    }
+    // update the main map, new files go behind the hand, so they are checked last
+    auto it = m_file_map.find(name);
+    if (m_file_map.end() == it) {
+        m_file_map[name] = entry{f, m_clock.insert(m_clock_hand, name)};
+    } else {
+        m_cached_bytes -= it->second.ptr->memory();
+        it->second.ptr = f;
+    }
+    m_cached_bytes += f->memory();
+    evict_cold();
+    return f;
+}
+
+void file_cache::drop(const std::string& name) {
+    auto it = m_file_map.find(name);
+    if (m_file_map.end() == it) {
+        return;
+    }
+    if (m_clock_hand == it->second.clock_pos) {
+        ++m_clock_hand;
+    }
+    m_clock.erase(it->second.clock_pos);
+    m_cached_bytes -= it->second.ptr->memory();
+    m_file_map.erase(it);
+    // update the local caches
+    for (auto* iosvc : m_iosvcs) {
+        iosvc->post([name] { m_file_map_local->erase(name_ref{name, boost::string_ref()}); });
+    }
+}
+
+void file_cache::evict_cold() {
+    if (0 == m_cache_size) {
+        return;
+    }
+    // each step clears a reference bit or evicts a file, so we are done after two rounds at most
+    while (m_cached_bytes > m_cache_size && !m_clock.empty()) {
+        if (m_clock.end() == m_clock_hand) {
+            m_clock_hand = m_clock.begin();
+        }
+        auto it = m_file_map.find(*m_clock_hand);
+        if (m_file_map.end() == it) {
+            // can not happen, every file on the clock is in the map
+            BOOST_ASSERT_MSG(false, "file on the clock is not in the map");
+            m_clock_hand = m_clock.erase(m_clock_hand);
+            continue;
+        }
+        auto& f = it->second.ptr;
+        if (f->m_referenced.exchange(false, std::memory_order_relaxed)) {
+            ++m_clock_hand;
+        } else {
+            auto name = *m_clock_hand;
+            log_debug("evicting object " << name << " (" << f->memory() << " bytes)");
+            drop(name);
+        }
+    }
+}
+
 }  // petrel
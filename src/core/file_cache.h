@@ -8,7 +8,13 @@
 #ifndef FILE_CACHE_H
 #define FILE_CACHE_H
 
+#include <array>
+#include <atomic>
 #include <boost/core/noncopyable.hpp>
+#include <cstdint>
+#include <ctime>
+#include <limits>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -18,6 +24,7 @@
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include "log.h"
 
@@ -26,24 +33,46 @@ namespace petrel {
 namespace ba = boost::asio;
 
 /// file_cache class
-/// The cache is loading and refreshing directories contents and
-/// provides access to the file contents. We use polling for now to
-/// keep things portable as static file delivery is not our main
-/// purpose.
+/// The cache is tracking directories contents and provides access to
+/// the file contents. Files get loaded on their first request and
+/// cold files get evicted via the CLOCK algorithm once the cache
+/// exceeds its memory budget. Changes are picked up via inotify on
+/// Linux. If inotify is not available, we fall back to polling.
 class file_cache : boost::noncopyable {
     set_log_tag("file_cache");
 
   public:
-    class file {
+    /// A cached file. The contents get mapped into memory and the file stays open, so it can be sent via
+    /// sendfile(2). Files should be replaced atomically (e.g. by rename), as truncating a mapped file makes reading
+    /// the mapping fail. Large files are not mapped, their content is read from disk on each request (see streamed()).
+    class file : boost::noncopyable {
         set_log_tag("file_cache::file");
 
       public:
-        using buffer_type = std::vector<char>;
+        /// Content codings of compressed variants
+        enum class encoding { identity, gzip, br };
 
-        file(const std::string& name, bool read_from_disk = false);
+        /// Ctor.
+        ///
+        /// @param name The absolute path of the file
+        /// @param read_from_disk Open the file, otherwise only the size and the write time are read
+        /// @param max_mapped_size Larger files are opened but not mapped
+        file(const std::string& name, bool read_from_disk = false,
+             std::size_t max_mapped_size = std::numeric_limits<std::size_t>::max());
 
-        /// Return the file data
-        const buffer_type& data() const { return m_data; }
+        /// Create a file from a memory buffer, used for compressed variants
+        file(std::vector<char> buf, std::time_t time);
+
+        ~file();
+
+        /// Return the absolute path of the file, empty for in memory files
+        const std::string& name() const { return m_name; }
+
+        /// Return the file data, empty for streamed files
+        boost::string_ref data() const { return boost::string_ref(m_data, nullptr != m_data ? m_size : 0); }
+
+        /// Return the file descriptor or -1 if the file has not been loaded
+        int fd() const { return m_fd; }
 
         /// Return the size of the file
         std::size_t size() const { return m_size; }
@@ -51,18 +80,67 @@ class file_cache : boost::noncopyable {
         /// Return the last time the file was written.
         std::time_t time() const { return m_time; }
 
+        /// Return the entity tag of the file (including the quotes). Only set for loaded files. It is computed from the
+        /// content, except for streamed files where it is made of the size and the write time.
+        const std::string& etag() const { return m_etag; }
+
+        /// Return the last write time as HTTP date. Only set for loaded files.
+        const std::string& last_modified() const { return m_last_modified; }
+
         /// Return true if the file wasy loaded successfully.
         bool good() const { return m_good; }
 
+        /// Return true if the file is not held in memory. The content has to be read via fd().
+        bool streamed() const { return m_streamed; }
+
+        /// Return the number of bytes the file and its variants hold in memory
+        std::size_t memory() const;
+
+        /// Return a compressed variant of the file or nullptr if there is none
+        const std::shared_ptr<file>& variant(encoding enc) const { return m_variants[static_cast<int>(enc)]; }
+
+        /// Return true if the file has compressed variants
+        bool has_variants() const { return nullptr != variant(encoding::gzip) || nullptr != variant(encoding::br); }
+
+        /// Load the compressed variants of a file. Precompressed siblings (name.br, name.gz) are picked up. If there
+        /// is no gzip sibling and the file type is known to compress well, the file gets compressed, unless it is
+        /// streamed.
+        void load_variants();
+
       private:
+        friend class file_cache;
+
         std::string m_name;
-        buffer_type m_data;
+        const char* m_data = nullptr;
+        int m_fd = -1;
         std::size_t m_size = 0;
         std::time_t m_time = 0;
         bool m_good = false;
+        bool m_streamed = false;
+        /// The CLOCK reference bit, set on each lookup
+        std::atomic_bool m_referenced{true};
+        std::string m_etag;
+        std::string m_last_modified;
+        std::vector<char> m_buffer;  // the data of in memory files
+        std::array<std::shared_ptr<file>, 3> m_variants;
+
+        /// Compute the entity tag and the HTTP date
+        void init_validators();
     };
 
-    explicit file_cache(int refresh_time = 5);
+    /// Format a time as HTTP date (IMF-fixdate)
+    static std::string to_http_date(std::time_t t);
+
+    /// Parse a HTTP date (IMF-fixdate), returns -1 on errors
+    static std::time_t from_http_date(const std::string& s);
+
+    /// Ctor.
+    ///
+    /// @param refresh_time The polling interval in seconds if inotify is not available
+    /// @param cache_size The memory budget in bytes, 0 means unlimited
+    /// @param stream_threshold The content of files larger than this is not held in memory but streamed from disk
+    explicit file_cache(int refresh_time = 5, std::size_t cache_size = 0,
+                        std::size_t stream_threshold = std::numeric_limits<std::size_t>::max());
     ~file_cache();
 
     /// Register an io service object. As we are running one io service per worker we can use post() to execute cache
@@ -82,7 +160,7 @@ class file_cache : boost::noncopyable {
     /// @return true on success
     bool add_directory(const std::string& name);
 
-    /// Add a single file to the cache
+    /// Add a single file to the cache. The file gets loaded on its first request, a loaded file gets reloaded.
     ///
     /// @param name The absolute path of the file
     /// @return true on success
@@ -93,29 +171,136 @@ class file_cache : boost::noncopyable {
     /// @param name The absolute path of the file
     void remove_file(const std::string& name);
 
-    /// Get a file object from the cache
+    /// Get a file object from the cache, loads the file if needed
     ///
     /// @param name The absolute path to the file
-    std::shared_ptr<file> get_file(const std::string& name);
+    std::shared_ptr<file> get_file(const std::string& name) { return get_file(name, boost::string_ref()); }
+
+    /// Get a file object from the cache, loads the file if needed. The path is passed in two parts, so files that are
+    /// in the thread local cache can be found without building the path. Other lookups build it in a buffer that is
+    /// kept per thread, so only loading a file allocates.
+    ///
+    /// @param dir The absolute path of the directory including a trailing slash
+    /// @param rel The path of the file relative to dir
+    std::shared_ptr<file> get_file(boost::string_ref dir, boost::string_ref rel);
+
+    /// Return the number of bytes the loaded files hold in memory
+    std::size_t cached_bytes();
 
   private:
     std::unordered_set<std::string> m_directories;
     std::mutex m_dir_mtx;
 
-    using file_map_type = std::unordered_map<std::string, std::shared_ptr<file>>;
+    /// A file name made of two parts, the key of the thread local maps. Keys of map entries reference the name of
+    /// the file they map to.
+    struct name_ref {
+        boost::string_ref dir;
+        boost::string_ref rel;
+    };
+
+    /// FNV-1a over both parts, so the hash is the one of the whole name
+    struct name_hash {
+        std::size_t operator()(const name_ref& n) const {
+            std::uint64_t hash = UINT64_C(14695981039346656037);
+            for (auto c : n.dir) {
+                hash ^= static_cast<unsigned char>(c);
+                hash *= UINT64_C(1099511628211);
+            }
+            for (auto c : n.rel) {
+                hash ^= static_cast<unsigned char>(c);
+                hash *= UINT64_C(1099511628211);
+            }
+            return static_cast<std::size_t>(hash);
+        }
+    };
 
-    file_map_type m_file_map;
+    /// Compares the whole names, independent of where they are split
+    struct name_equal {
+        bool operator()(const name_ref& a, const name_ref& b) const {
+            if (a.dir.size() + a.rel.size() != b.dir.size() + b.rel.size()) {
+                return false;
+            }
+            auto& s = a.dir.size() <= b.dir.size() ? a : b;
+            auto& l = a.dir.size() <= b.dir.size() ? b : a;
+            auto k = l.dir.size() - s.dir.size();
+            return s.dir == l.dir.substr(0, s.dir.size()) && s.rel.substr(0, k) == l.dir.substr(s.dir.size()) &&
+                   s.rel.substr(k) == l.rel;
+        }
+    };
+
+    using file_map_type = std::unordered_map<name_ref, std::shared_ptr<file>, name_hash, name_equal>;
+
+    struct entry {
+        std::shared_ptr<file> ptr;
+        std::list<std::string>::iterator clock_pos;
+    };
+
+    /// The loaded files (guarded by m_file_mtx)
+    std::unordered_map<std::string, entry> m_file_map;
+    /// All files in the cached directories (guarded by m_file_mtx)
+    std::unordered_set<std::string> m_known_files;
+    /// The CLOCK of the loaded files and its hand (guarded by m_file_mtx)
+    std::list<std::string> m_clock;
+    std::list<std::string>::iterator m_clock_hand;
+    std::size_t m_cached_bytes = 0;
     std::mutex m_file_mtx;
 
+    /// Serializes loading files, so a file is loaded once and a lazy load can not overwrite a reload with old data
+    std::mutex m_load_mtx;
+
+    std::size_t m_cache_size;
+    std::size_t m_stream_threshold;
+
     static thread_local std::unique_ptr<file_map_type> m_file_map_local;
 
+    /// Add a file to the thread local map
+    static void set_local(const std::shared_ptr<file>& f);
+
     std::thread m_thread;
-    bool m_stop = false;
+    std::atomic_bool m_stop{false};
+
+    /// The inotify instance or -1 if we are polling
+    int m_inotify_fd = -1;
+    /// The watched directories by watch descriptor (guarded by m_dir_mtx)
+    std::unordered_map<int, std::string> m_watches;
 
     std::vector<ba::io_service*> m_iosvcs;
 
     bool scan_directory(const std::string& name);
     std::shared_ptr<file> get_file_main(const std::string& name);
+
+    /// Return true if the file is in one of the cached directories
+    bool known_file(const std::string& name);
+
+    /// Load a file that has been requested the first time
+    std::shared_ptr<file> load_file(const std::string& name);
+
+    /// Load a file and update the maps, the caller has to hold m_load_mtx
+    std::shared_ptr<file> load(const std::string& name);
+
+    /// Drop a loaded file from the main and the local maps, the caller has to hold m_file_mtx
+    void drop(const std::string& name);
+
+    /// Evict cold files until we are within the memory budget, the caller has to hold m_file_mtx
+    void evict_cold();
+
+    /// Check all directories and files for changes every refresh_time seconds
+    void poll_files(int refresh_time);
+
+    /// Check all directories and files for changes
+    void refresh_all();
+
+    /// Wait for inotify events and update the changed files
+    void watch_files();
+
+    /// Handle an inotify event
+    void handle_event(int wd, std::uint32_t mask, const std::string& name);
+
+    /// Add an inotify watch for a directory
+    void add_watch(const std::string& name);
+
+    /// Remove all files below a directory
+    void remove_directory_files(const std::string& name);
 };
 
 inline bool operator==(const file_cache::file& lhs, const file_cache::file& rhs) {
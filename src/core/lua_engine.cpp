@@ -6,6 +6,7 @@
  */
 
 #include "lua_engine.h"
+#include "fiber_sched_algorithm.h"
 #include "lib/library.h"
 #include "lua_utils.h"
 #include "server.h"
@@ -26,6 +27,9 @@ namespace petrel {
 // Initialize log members
 init_log_static(lua_engine, log_priority::info);
 
+// The address is used as key to store the request pointer in a request table
+char lua_engine::request_key = 0;
+
 /// Log an error, dump the stack and throw a runtime_error
 inline void log_throw(lua_State* L, const std::string& path, std::initializer_list<boost::string_ref> msg) {
     std::ostringstream os;
@@ -67,35 +71,106 @@ void lua_engine::bootstrap(server& srv) {
     m_state_mgr.print_registered_libs();
 }
 
-void lua_engine::handle_request(const std::string& func, request::pointer req) {
-    auto Lex = m_state_mgr.get_state();
+std::size_t lua_engine::register_handler(const std::string& func) {
+    for (std::size_t id = 0; id < m_handlers.size(); ++id) {
+        if (m_handlers[id] == func) {
+            return id;
+        }
+    }
+    m_handlers.push_back(func);
+    return m_handlers.size() - 1;
+}
+
+void lua_engine::push_handler(lua_state_ex& Lex, std::size_t id, request::pointer& req) {
     auto* L = Lex.L;
-    Lex.ctx->p_server = &req->get_server();
-    Lex.ctx->p_io_service = &req->get_io_service();
-    // Call func
+    auto& refs = *Lex.handler_refs;
+    if (unlikely(refs.size() <= id)) {
+        refs.resize(m_handlers.size(), LUA_NOREF);
+    }
+    if (likely(LUA_NOREF != refs[id])) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, refs[id]);
+        return;
+    }
+    auto& func = m_handlers[id];
     lua_getglobal(L, func.c_str());
     if (!lua_isfunction(L, -1)) {
         log_throw(L, req->path(), {"handler function", func, "not defined"});
     }
+    lua_pushvalue(L, -1);
+    refs[id] = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+void lua_engine::handle_request(std::size_t id, request::pointer req) {
+    auto Lex = m_state_mgr.get_state();
+    auto* L = Lex.L;
+    Lex.ctx->p_server = &req->get_server();
+    // with work stealing the handler might run in another thread than the request, library objects have to use
+    // the io_service of the thread that runs the handler
+    auto* iosvc = fiber_sched_algorithm::current_io_service();
+    Lex.ctx->p_io_service = nullptr != iosvc ? iosvc : &req->get_io_service();
+    // Call the handler
+    push_handler(Lex, id, req);
     push_request(L, req);
-    push_response(L);
+    // keep a reference to the request object below the function, so we can detach it after the call
+    lua_pushvalue(L, -1);
+    lua_insert(L, -3);
+    push_response(Lex, req);
+    // same for the response object
+    lua_pushvalue(L, -1);
+    lua_insert(L, -4);
+    int req_idx = lua_gettop(L) - 4;
     if (lua_pcall(L, 2, 1, Lex.traceback_idx)) {
         log_throw(nullptr, req->path(), {"lua_pcall failed:", lua_tostring(L, -1)});
     }
-    // Get the response
-    if (!lua_istable(L, -1)) {
-        log_throw(L, req->path(), {"repsonse is no table"});
+    bf::future<void> written;
+    if (req->chunked()) {
+        // The handler streamed the response via response:write(), the return value is ignored
+        req->finish_chunks();
+    } else {
+        // Get the response
+        if (!lua_istable(L, -1)) {
+            log_throw(L, req->path(), {"repsonse is no table"});
+        }
+        lua_getfield(L, -1, "status");
+        if (!lua_isnumber(L, -1)) {
+            log_throw(L, req->path(), {"response.status is no number"});
+        }
+        int status = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (!add_response_headers(L, lua_gettop(L), *req)) {
+            log_throw(L, req->path(), {"repsonse.headers is no table"});
+        }
+        // Get the content
+        lua_getfield(L, -1, "content");
+        if (!lua_isstring(L, -1)) {
+            log_throw(L, req->path(), {"response.content is no string"});
+        }
+        std::size_t content_len;
+        auto* content_ptr = lua_tolstring(L, -1, &content_len);
+        // The content is sent without copying it. It stays referenced on the stack until it has been written.
+        written = req->send_response_nocopy(status, boost::string_ref(content_ptr, content_len));
     }
-    lua_getfield(L, -1, "status");
-    if (!lua_isnumber(L, -1)) {
-        log_throw(L, req->path(), {"response.status is no number"});
+    // The request and response objects might have been stored somewhere by the handler, so make sure they do not
+    // point to the request anymore
+    lua_pushlightuserdata(L, &request_key);
+    lua_pushnil(L);
+    lua_rawset(L, req_idx);
+    lua_pushlightuserdata(L, &request_key);
+    lua_pushnil(L);
+    lua_rawset(L, req_idx + 1);
+    if (written.valid()) {
+        written.wait();
     }
-    int status = lua_tointeger(L, -1);
-    lua_pop(L, 1);
-    // Iterate through response headers
-    lua_getfield(L, -1, "headers");
+    // Clean up (remove the request, the response, the return value and the content)
+    lua_settop(L, req_idx - 1);
+    m_state_mgr.free_state(Lex);
+}
+
+bool lua_engine::add_response_headers(lua_State* L, int res_idx, request& req) {
+    lua_getfield(L, res_idx, "headers");
     if (!lua_istable(L, -1)) {
-        log_throw(L, req->path(), {"repsonse.headers is no table"});
+        lua_pop(L, 1);
+        return false;
     }
     int hdr_i = lua_gettop(L);
     lua_pushnil(L);
@@ -103,22 +178,12 @@ void lua_engine::handle_request(const std::string& func, request::pointer req) {
         if (lua_isstring(L, -1) && lua_isstring(L, -2)) {
             const char* name = lua_tostring(L, -2);
             const char* val = lua_tostring(L, -1);
-            req->add_header(name, val);
+            req.add_header(name, val);
         }
         lua_pop(L, 1);
     }
     lua_pop(L, 1);
-    // Get the content
-    lua_getfield(L, -1, "content");
-    if (!lua_isstring(L, -1)) {
-        log_throw(L, req->path(), {"response.content is no string"});
-    }
-    std::size_t content_len;
-    auto* content_ptr = lua_tolstring(L, -1, &content_len);
-    req->send_response(status, boost::string_ref(content_ptr, content_len));
-    // Clean up (remove return value and the traceback)
-    lua_pop(L, 2);
-    m_state_mgr.free_state(Lex);
+    return true;
 }
 
 void lua_engine::push_cookies(lua_State* L, const std::string& cookies) {
@@ -152,47 +217,193 @@ void lua_engine::push_cookies(lua_State* L, const std::string& cookies) {
 }
 
 void lua_engine::push_request(lua_State* L, request::pointer req) {
-    lua_createtable(L, 0, 9);
-    lua_pushinteger(L, std::time(nullptr));
-    lua_setfield(L, -2, "timestamp");
-    lua_pushstring(L, req->method_string().c_str());
-    lua_setfield(L, -2, "method");
-    lua_pushstring(L, req->proto().c_str());
-    lua_setfield(L, -2, "proto");
-    lua_pushstring(L, req->host().c_str());
-    lua_setfield(L, -2, "host");
-    lua_pushstring(L, req->path().c_str());
-    lua_setfield(L, -2, "path");
-    lua_createtable(L, 0, req->headers_size());
-    std::for_each(req->headers_begin(), req->headers_end(), [L](const request::header_iterator& h) {
-        lua_pushstring(L, h.second().c_str());
-        lua_setfield(L, -2, h.first().c_str());
-    });
-    lua_setfield(L, -2, "headers");
-    auto addr = req->remote_endpoint().address();
-    lua_pushstring(L, addr.to_string().c_str());
-    lua_setfield(L, -2, "remote_addr_str");
-    lua_pushinteger(L, addr.is_v4() ? 4 : 6);
-    lua_setfield(L, -2, "remote_addr_ip_ver");
-    if (req->header_exists("cookie")) {
+    // The request object is a table that gets populated on access via the __index metamethod
+    lua_createtable(L, 0, 4);
+    lua_pushlightuserdata(L, &request_key);
+    lua_pushlightuserdata(L, req.get());
+    lua_rawset(L, -3);
+    if (luaL_newmetatable(L, "petrel_request")) {
+        lua_pushcfunction(L, request_index);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+}
+
+int lua_engine::request_index(lua_State* L) {
+    lua_pushlightuserdata(L, &request_key);
+    lua_rawget(L, 1);
+    auto* req = reinterpret_cast<request*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if (nullptr == req || lua_type(L, 2) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
+    }
+    std::size_t len;
+    const char* key_ptr = lua_tolstring(L, 2, &len);
+    boost::string_ref key(key_ptr, len);
+    if (key == "method") {
+        auto& m = req->method_string();
+        lua_pushlstring(L, m.data(), m.size());
+    } else if (key == "path") {
+        auto& p = req->path();
+        lua_pushlstring(L, p.data(), p.size());
+    } else if (key == "host") {
+        auto& h = req->host();
+        lua_pushlstring(L, h.data(), h.size());
+    } else if (key == "headers") {
+        lua_createtable(L, 0, req->headers_size());
+        std::for_each(req->headers_begin(), req->headers_end(), [L](const request::header_iterator& h) {
+            lua_pushlstring(L, h.second().data(), h.second().size());
+            lua_setfield(L, -2, h.first().c_str());
+        });
+    } else if (key == "cookies") {
+        if (!req->header_exists("cookie")) {
+            lua_pushnil(L);
+            return 1;
+        }
         push_cookies(L, req->header("cookie"));
-        lua_setfield(L, -2, "cookies");
+    } else if (key == "content") {
+        if (req->method() == request::http_method::GET) {
+            lua_pushnil(L);
+            return 1;
+        }
+        if (req->body_streaming()) {
+            // read the rest of the body
+            luaL_Buffer b;
+            luaL_buffinit(L, &b);
+            std::string chunk;
+            while (req->read_body_chunk(chunk)) {
+                luaL_addlstring(&b, chunk.data(), chunk.size());
+            }
+            luaL_pushresult(&b);
+        } else {
+            auto content = req->content();
+            lua_pushlstring(L, content.data(), content.size());
+        }
+    } else if (key == "read_body_chunk") {
+        lua_pushcfunction(L, request_read_body_chunk);
+    } else if (key == "params") {
+        if (req->params().empty()) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_createtable(L, 0, req->params().size());
+        for (auto& p : req->params()) {
+            lua_pushlstring(L, p.second.data(), p.second.size());
+            lua_setfield(L, -2, p.first.c_str());
+        }
+    } else if (key == "timestamp") {
+        lua_pushinteger(L, req->timestamp());
+    } else if (key == "proto") {
+        auto& p = req->proto();
+        lua_pushlstring(L, p.data(), p.size());
+    } else if (key == "remote_addr_str") {
+        lua_pushstring(L, req->remote_endpoint().address().to_string().c_str());
+    } else if (key == "remote_addr_ip_ver") {
+        lua_pushinteger(L, req->remote_endpoint().address().is_v4() ? 4 : 6);
+    } else {
+        lua_pushnil(L);
+        return 1;
+    }
+    // store the value in the table, so the next access does not end up here again
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+int lua_engine::request_read_body_chunk(lua_State* L) {
+    if (!lua_istable(L, 1)) {
+        return luaL_error(L, "read_body_chunk: request expected, use request:read_body_chunk()");
+    }
+    lua_pushlightuserdata(L, &request_key);
+    lua_rawget(L, 1);
+    auto* req = reinterpret_cast<request*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    std::string chunk;
+    if (nullptr == req || !req->read_body_chunk(chunk)) {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L, chunk.data(), chunk.size());
+    }
+    return 1;
+}
+
+request* lua_engine::get_response_request(lua_State* L) {
+    if (!lua_istable(L, 1)) {
+        luaL_error(L, "response expected, use the : operator to call response methods");
     }
-    if (req->method() == request::http_method::POST) {
-        auto content = req->content();
-        lua_pushlstring(L, content.data(), content.size());
-        lua_setfield(L, -2, "content");
+    lua_pushlightuserdata(L, &request_key);
+    lua_rawget(L, 1);
+    auto* req = reinterpret_cast<request*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if (nullptr == req) {
+        luaL_error(L, "the request has been finished already");
     }
+    return req;
 }
 
-void lua_engine::push_response(lua_State* L) {
-    lua_createtable(L, 0, 3);
+int lua_engine::response_write(lua_State* L) {
+    auto* req = get_response_request(L);
+    std::size_t len;
+    auto* chunk = luaL_checklstring(L, 2, &len);
+    int status = 200;
+    if (!req->chunked()) {
+        // the first chunk, the status and headers get sent now
+        lua_getfield(L, 1, "status");
+        if (lua_isnumber(L, -1)) {
+            status = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+        add_response_headers(L, 1, *req);
+    }
+    lua_pushboolean(L, req->write_chunk(status, boost::string_ref(chunk, len)));
+    return 1;
+}
+
+int lua_engine::response_finish(lua_State* L) {
+    auto* req = get_response_request(L);
+    if (!req->chunked()) {
+        // nothing has been written, so the response is empty
+        lua_getfield(L, 1, "status");
+        int status = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 200;
+        lua_pop(L, 1);
+        add_response_headers(L, 1, *req);
+        req->write_chunk(status, boost::string_ref());
+    }
+    req->finish_chunks();
+    return 0;
+}
+
+void lua_engine::push_response(lua_state_ex& Lex, request::pointer& req) {
+    auto* L = Lex.L;
+    // The handler can keep the response table, e.g. in an upvalue, so every request gets a new one. Only the
+    // metatable is shared.
+    lua_createtable(L, 0, 4);
+    lua_createtable(L, 0, 0);
+    lua_setfield(L, -2, "headers");
     lua_pushinteger(L, 200);
     lua_setfield(L, -2, "status");
-    lua_pushstring(L, "");
+    lua_pushliteral(L, "");
     lua_setfield(L, -2, "content");
-    lua_createtable(L, 0, 0);
-    lua_setfield(L, -2, "headers");
+    lua_pushlightuserdata(L, &request_key);
+    lua_pushlightuserdata(L, req.get());
+    lua_rawset(L, -3);
+    if (unlikely(LUA_NOREF == Lex.response_meta_ref)) {
+        // response methods
+        lua_createtable(L, 0, 1);
+        lua_createtable(L, 0, 2);
+        lua_pushcfunction(L, response_write);
+        lua_setfield(L, -2, "write");
+        lua_pushcfunction(L, response_finish);
+        lua_setfield(L, -2, "finish");
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        Lex.response_meta_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, Lex.response_meta_ref);
+    }
+    lua_setmetatable(L, -2);
 }
 
 }  // petrel
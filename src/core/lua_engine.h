@@ -36,8 +36,21 @@ class lua_engine : boost::noncopyable {
     /// Call the bootstrap function in lua to setup the server
     void bootstrap(server& srv);
 
+    /// Register a lua function as request handler. Handler functions get resolved once per lua state and are
+    /// referenced by id afterwards. Handlers have to be registered before the workers are started.
+    ///
+    /// @param func The name of the lua function
+    /// @return The handler id
+    std::size_t register_handler(const std::string& func);
+
+    /// Return the function name of a handler
+    const std::string& handler_name(std::size_t id) const { return m_handlers[id]; }
+
     /// Handle an incoming http request
-    void handle_request(const std::string& func, request::pointer req);
+    ///
+    /// @param id The handler id as returned by register_handler
+    /// @param req The request
+    void handle_request(std::size_t id, request::pointer req);
 
     /// Return the state manager
     lua_state_manager& state_manager() { return m_state_mgr; }
@@ -45,12 +58,39 @@ class lua_engine : boost::noncopyable {
   private:
     lua_state_manager m_state_mgr;
 
+    /// Handler function names indexed by handler id
+    std::vector<std::string> m_handlers;
+
+    /// Push the handler function to the stack. The function gets looked up on the first call for a state and is
+    /// stored in the registry.
+    void push_handler(lua_state_ex& Lex, std::size_t id, request::pointer& req);
+
+    /// Key for the request pointer in request tables
+    static char request_key;
+
     /// Create a cookie table on the given lua state
-    void push_cookies(lua_State* L, const std::string& cookies);
-    /// Create a lua table object out of the http request and push it to the stack
+    static void push_cookies(lua_State* L, const std::string& cookies);
+    /// Create a lua table object for the http request and push it to the stack. The fields get materialized on first
+    /// access by request_index.
     void push_request(lua_State* L, const request::pointer req);
-    /// Create an empty response lua table that has all required fields and some defaults
-    void push_response(lua_State* L);
+    /// The __index metamethod of request tables
+    static int request_index(lua_State* L);
+    /// request:read_body_chunk() returns the next chunk of the request body or nil at the end of the body. Yields the
+    /// fiber until data is available if the body is streamed.
+    static int request_read_body_chunk(lua_State* L);
+    /// Push an empty response lua table that has all required fields and some defaults. The metatable gets created
+    /// once per state.
+    void push_response(lua_state_ex& Lex, request::pointer& req);
+    /// Add the headers of the response table at res_idx to the request. Returns false if the headers field is no
+    /// table.
+    static bool add_response_headers(lua_State* L, int res_idx, request& req);
+    /// Return the request of the response table at index 1, raises a lua error if there is none
+    static request* get_response_request(lua_State* L);
+    /// response:write(chunk) sends a chunk of a streaming response. The first call sends the status and headers.
+    /// Returns false if the client is gone.
+    static int response_write(lua_State* L);
+    /// response:finish() ends a streaming response
+    static int response_finish(lua_State* L);
 };
 
 }  // petrel
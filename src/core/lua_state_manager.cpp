@@ -184,6 +184,7 @@ lua_state_ex lua_state_manager::create_state() {
     Lex.ctx->p_server = nullptr;
     Lex.ctx->p_io_service = nullptr;
     Lex.ctx->p_objects = new std::vector<lib::library*>;
+    Lex.handler_refs = new std::vector<int>;
 
     // Add the context to the global env
     lua_setglobal(Lex.L, "petrel_context");
@@ -200,6 +201,7 @@ void lua_state_manager::destroy_state(lua_state_ex L) {
             L.ctx->p_objects->clear();
             delete L.ctx->p_objects;
         }
+        delete L.handler_refs;
         lua_close(L.L);
     }
 }
@@ -222,6 +224,8 @@ lua_state_ex lua_state_manager::get_state() {
     } else {
         if (unlikely(m_dev_mode)) {
             lua_utils::load_code_from_scripts(Lex.L, m_scripts);
+            // the handler functions have been replaced
+            release_handler_refs(Lex);
         }
     }
     return Lex;
@@ -242,6 +246,15 @@ void lua_state_manager::free_state(lua_state_ex Lex) {
     }
 }
 
+void lua_state_manager::release_handler_refs(lua_state_ex& Lex) {
+    if (nullptr != Lex.handler_refs) {
+        for (auto ref : *Lex.handler_refs) {
+            luaL_unref(Lex.L, LUA_REGISTRYINDEX, ref);
+        }
+        Lex.handler_refs->clear();
+    }
+}
+
 void lua_state_manager::add_lua_code(const std::string& code) {
     std::lock_guard<std::mutex> lock(m_code_mtx);
     m_code.push_back(code);
@@ -31,6 +31,11 @@ struct lua_state_ex {
     int traceback_idx = 0;
     lib::lib_context* ctx = nullptr;
     std::uint_fast64_t code_version = 0;
+    /// Registry references to the handler functions of the state indexed by handler id (see
+    /// lua_engine::register_handler). LUA_NOREF if a handler has not been resolved yet.
+    std::vector<int>* handler_refs = nullptr;
+    /// Registry reference to the metatable of the response tables
+    int response_meta_ref = LUA_NOREF;
 };
 
 using lib_load_func_type = std::function<void()>;
@@ -148,6 +153,9 @@ class lua_state_manager : boost::noncopyable {
 
     /// Initialize libraries
     static void load_libs(lua_State* L);
+
+    /// Release all cached handler references of a state
+    static void release_handler_refs(lua_state_ex& Lex);
 };
 
 }  // petrel
@@ -43,8 +43,20 @@ bool options::parse(int argc, const char** argv) {
            "SSL/TLS certificate file")
         ("server.http1",
            "Run an HTTP/1.1 server (No SSL/TLS support)")
+        ("server.reuseport",
+           "Let every worker listen on the server port via SO_REUSEPORT instead of accepting connections in one "
+           "worker (HTTP/1.1 only).")
+        ("server.work-stealing",
+           "Allow request handler fibers to be moved between worker threads to balance the load.")
+        ("server.pipeline-depth", bpo::value<int>()->default_value(16),
+           "Max number of pipelined HTTP/1.1 requests per connection that are processed in parallel.")
+        ("server.http2-stream-body",
+           "Run HTTP/2 request handlers before the request body has been received. Handlers can read the body in "
+           "chunks via request:read_body_chunk().")
         ("server.dns-cache-ttl", bpo::value<int>()->default_value(5),
            "DNS cache TTL in minutes")
+        ("server.dns-cache-negative-ttl", bpo::value<int>()->default_value(10),
+           "DNS cache TTL of failed lookups in seconds")
         ;
     bpo::options_description desc_lua("LUA options");
     desc_lua.add_options()
@@ -74,6 +86,23 @@ bool options::parse(int argc, const char** argv) {
         ("log.level", bpo::value<int>()->default_value(log::to_int(log_priority::info)),
            level_msg.str().c_str())
         ;
+    bpo::options_description desc_files("File cache options");
+    desc_files.add_options()
+        ("files.cache-size", bpo::value<int>()->default_value(256),
+           "The memory budget of the static file cache in MiB, 0 means unlimited. Files are loaded on their first "
+           "request and cold files get evicted if the budget is exceeded.")
+        ("files.stream-threshold", bpo::value<int>()->default_value(1024),
+           "The content of files larger than N KiB is not held in memory but streamed from disk.")
+        ;
+    bpo::options_description desc_client("Client options");
+    desc_client.add_options()
+        ("client.keepalive-timeout", bpo::value<int>()->default_value(30),
+           "Close idle upstream connections of the http_client library after N seconds.")
+        ("client.keepalive-max-idle", bpo::value<int>()->default_value(16),
+           "Max number of idle upstream connections per host and worker, 0 disables connection reuse.")
+        ("client.http2-max-streams", bpo::value<int>()->default_value(100),
+           "Max number of concurrent streams per HTTP/2 upstream session of the http2_client library.")
+        ;
     bpo::options_description desc_metrics("Metrics options");
     desc_metrics.add_options()
         ("metrics.log", bpo::value<int>()->default_value(0),
@@ -90,7 +119,7 @@ bool options::parse(int argc, const char** argv) {
            "The name prefix for metrics send to graphite. A metric name will be constructed as "
            "follows: <prefix>.<hostname>.<metricname>")
         ;
-    desc.add(desc_help).add(desc_srv).add(desc_lua).add(desc_log).add(desc_metrics);
+    desc.add(desc_help).add(desc_srv).add(desc_lua).add(desc_log).add(desc_files).add(desc_client).add(desc_metrics);
     // clang-format on
 
     try {
@@ -100,7 +129,7 @@ bool options::parse(int argc, const char** argv) {
         }
         if (opts.count("config")) {
             bpo::options_description desc_file;
-            desc_file.add(desc_srv).add(desc_lua).add(desc_log).add(desc_metrics);
+            desc_file.add(desc_srv).add(desc_lua).add(desc_log).add(desc_files).add(desc_client).add(desc_metrics);
             std::fstream f(opts["config"].as<std::string>());
             bpo::store(bpo::parse_config_file(f, desc_file), opts);
         }
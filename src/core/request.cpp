@@ -5,12 +5,60 @@
  * Author: Andreas Pohl
  */
 
+#include <mutex>
+
 #include "request.h"
 
 namespace petrel {
 
 const std::string request::EMPTY;
 
+void request::body_stream::push(const std::uint8_t* data, std::size_t len) {
+    {
+        std::lock_guard<bf::mutex> lock(m_mtx);
+        if (m_eof) {
+            return;
+        }
+        if (len == 0) {
+            m_eof = true;
+        } else {
+            m_chunks.emplace_back(reinterpret_cast<const char*>(data), len);
+        }
+    }
+    m_cv.notify_one();
+}
+
+bool request::body_stream::pop(std::string& chunk) {
+    std::unique_lock<bf::mutex> lock(m_mtx);
+    m_cv.wait(lock, [this] { return m_eof || !m_chunks.empty(); });
+    if (m_chunks.empty()) {
+        return false;
+    }
+    chunk = std::move(m_chunks.front());
+    m_chunks.pop_front();
+    return true;
+}
+
+request::http2_stream::pointer request::http2_stream::attach(const http2::server::response& res) {
+    auto stream = std::make_shared<http2_stream>();
+    res.on_close([stream](std::uint32_t) { stream->close(); });
+    return stream;
+}
+
+void request::http2_stream::close() {
+    closed = true;
+    // a handler that reads the body must not wait for more data
+    if (nullptr != body) {
+        body->push(nullptr, 0);
+    }
+    if (nullptr != response_body) {
+        response_body->finish();
+    }
+    if (nullptr != chunks) {
+        chunks->close();
+    }
+}
+
 bool operator==(request::header_iterator& lhs, request::header_iterator& rhs) {
     if (lhs.m_mode != rhs.m_mode) {
         throw std::runtime_error("invalid iterator modes");
@@ -11,10 +11,20 @@
 #include <boost/asio.hpp>
 #include <boost/core/noncopyable.hpp>
 #include <boost/utility/string_ref.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <deque>
 #include <memory>
 #include <nghttp2/asio_http2_server.h>
-
-#include "fiber_sched_algorithm.h"
+#include <nghttp2/nghttp2.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "branch.h"
+#include "file_cache.h"
 #include "make_unique.h"
 #include "server.h"
 #include "session.h"
@@ -32,6 +42,7 @@ class request : boost::noncopyable {
     using pointer = std::shared_ptr<request>;
     using http2_content_buffer_type = std::vector<std::uint8_t>;
     using header_type = std::pair<const std::string&, const std::string&>;
+    using params_type = std::vector<std::pair<std::string, std::string>>;
 
     enum class mode { HTTP, HTTP2 };
 
@@ -39,6 +50,51 @@ class request : boost::noncopyable {
 
     static const std::string EMPTY;
 
+    /// A request body that gets filled by the transport while the request handler is running already
+    class body_stream : boost::noncopyable {
+      public:
+        using pointer = std::shared_ptr<body_stream>;
+
+        /// Append a chunk. An empty chunk marks the end of the body.
+        void push(const std::uint8_t* data, std::size_t len);
+
+        /// Return the next chunk. Blocks the calling fiber until data is available. Returns false at the end of the
+        /// body.
+        bool pop(std::string& chunk);
+
+      private:
+        bf::mutex m_mtx;
+        bf::condition_variable m_cv;
+        std::deque<std::string> m_chunks;
+        bool m_eof = false;
+    };
+
+  private:
+    struct http2_body;
+    struct http2_chunks;
+
+  public:
+    /// The state of a HTTP2 stream that has to be finished when the stream gets closed. nghttp2 keeps one close
+    /// callback per response, so the server registers it once per stream via attach() and everything that waits for
+    /// the stream is added here. Only used on the thread running the stream's io_service.
+    struct http2_stream : boost::noncopyable {
+        using pointer = std::shared_ptr<http2_stream>;
+
+        /// Create the state of a stream and register its close callback
+        static pointer attach(const http2::server::response& res);
+
+        /// Finish everything that waits for the stream, called by the close callback
+        void close();
+
+        /// The streamed request body, if any
+        body_stream::pointer body;
+        /// The response body or the chunks of a streaming response, once the response has been started
+        std::shared_ptr<http2_body> response_body;
+        std::shared_ptr<http2_chunks> chunks;
+        /// The stream is gone, the response object must not be used anymore
+        bool closed = false;
+    };
+
     class header_iterator {
       public:
         explicit header_iterator(http::headers::const_iterator it) : m_mode(mode::HTTP), m_http_iter(it) {}
@@ -91,30 +147,24 @@ class request : boost::noncopyable {
     /// HTTP ctor.
     explicit request(session::request_type::pointer req) : m_mode(mode::HTTP), m_http_request(req) {
         init();
-        fiber_sched_algorithm::update();
     }
 
     /// HTTP2 ctor.
     request(const http2::server::request& req, const http2::server::response& res, server& srv,
-            std::shared_ptr<http2_content_buffer_type> content)
+            std::shared_ptr<http2_content_buffer_type> content, http2_stream::pointer stream)
         : m_mode(mode::HTTP2), m_http2(std::make_unique<http2_data>(srv, req, res, content)) {
+        m_http2->stream = stream;
+        m_http2->body = stream->body;
         m_http2->path = req.uri().raw_path;
         if (!req.uri().raw_query.empty()) {
             m_http2->path += '?';
             m_http2->path += req.uri().raw_query;
         }
         init();
-        fiber_sched_algorithm::update();
-        // Decrease the request counter after the response (stream) is closed. This object might not exists anymore.
-        res.on_close([](std::uint32_t) { fiber_sched_algorithm::update(); });
     }
 
     /// Dtor.
-    virtual ~request() {
-        if (mode::HTTP == m_mode) {
-            fiber_sched_algorithm::update();
-        }
-    }
+    virtual ~request() {}
 
     /// Return the HTTP method string
     inline const std::string& method_string() const {
@@ -130,6 +180,9 @@ class request : boost::noncopyable {
     /// Return the HTTP method
     inline http_method method() const { return m_method; }
 
+    /// Return the time the request has been created
+    inline std::time_t timestamp() const { return m_timestamp; }
+
     /// Return the HTTP protocol
     inline const std::string& proto() const {
         switch (m_mode) {
@@ -180,6 +233,31 @@ class request : boost::noncopyable {
         throw std::runtime_error("invalid mode");
     }
 
+    /// Return true if the request body is streamed. In this case content() is empty and the body has to be read via
+    /// read_body_chunk().
+    inline bool body_streaming() const { return m_mode == mode::HTTP2 && nullptr != m_http2->body; }
+
+    /// Read the next chunk of the request body. For streamed bodies this blocks the calling fiber until data
+    /// arrived. Otherwise the whole content is returned by the first call.
+    ///
+    /// @param chunk Receives the data
+    /// @return false if the whole body has been read
+    bool read_body_chunk(std::string& chunk) {
+        if (body_streaming()) {
+            return m_http2->body->pop(chunk);
+        }
+        if (m_body_read) {
+            return false;
+        }
+        m_body_read = true;
+        auto c = content();
+        chunk.assign(c.data(), c.size());
+        return !chunk.empty();
+    }
+
+    /// Return the path parameters captured by the router
+    inline params_type& params() { return m_params; }
+
     /// Return the client endpoint
     const bai::tcp::endpoint& remote_endpoint() const {
         switch (m_mode) {
@@ -312,24 +390,414 @@ class request : boost::noncopyable {
         switch (m_mode) {
             case mode::HTTP:
                 if (content.size() > 0) {
-                    std::copy(content.begin(), content.end(),
-                              std::back_inserter(m_http_request->response.message.body()));
+                    auto& body = m_http_request->response.message.body();
+                    body.insert(body.end(), content.begin(), content.end());
                 }
                 m_http_request->response.status = code;
                 m_http_request->send_response();
                 break;
-            case mode::HTTP2:
-                std::string data(content.data(), content.size());
+            case mode::HTTP2: {
+                if (code != 304) {
+                    add_header("content-length", std::to_string(content.size()));
+                }
+                auto& res = m_http2->response;
+                auto& stream = m_http2->stream;
+                if (likely(std::this_thread::get_id() == m_http2->thread_id)) {
+                    if (!stream->closed) {
+                        std::string data(content.data(), content.size());
+                        res.write_head(code, std::move(m_http2->headers));
+                        res.end(std::move(data));
+                    }
+                } else {
+                    // The handler fiber has been moved to another thread (work stealing). nghttp2 is not thread safe,
+                    // so we have to send the response from the thread running the stream's io_service.
+                    auto headers = std::make_shared<http2::header_map>(std::move(m_http2->headers));
+                    auto data = std::make_shared<std::string>(content.data(), content.size());
+                    res.io_service().post([&res, stream, code, headers, data] {
+                        if (!stream->closed) {
+                            res.write_head(code, std::move(*headers));
+                            res.end(std::move(*data));
+                        }
+                    });
+                }
+                break;
+            }
+        }
+    }
+
+    /// Send a response without copying the content. The content has to stay valid until the returned future is
+    /// ready, that is when the transport does not access it anymore.
+    bf::future<void> send_response_nocopy(int code, boost::string_ref content) {
+        if (!response_header_exists("server")) {
+            add_header("server", "petrel");
+        }
+        switch (m_mode) {
+            case mode::HTTP: {
+                auto written = m_http_request->written_future();
+                m_http_request->response.body_ref = content;
+                m_http_request->response.status = code;
+                m_http_request->send_response();
+                return written;
+            }
+            case mode::HTTP2: {
                 add_header("content-length", std::to_string(content.size()));
-                m_http2->response.write_head(code, std::move(m_http2->headers));
-                m_http2->response.end(std::move(data));
+                auto body = std::make_shared<http2_body>(content);
+                auto written = body->written.get_future();
+                auto& res = m_http2->response;
+                auto stream = m_http2->stream;
+                if (likely(std::this_thread::get_id() == m_http2->thread_id)) {
+                    http2_body::send(body, res, *stream, code, std::move(m_http2->headers));
+                } else {
+                    // see send_response
+                    auto headers = std::make_shared<http2::header_map>(std::move(m_http2->headers));
+                    res.io_service().post([&res, stream, code, headers, body] {
+                        http2_body::send(body, res, *stream, code, std::move(*headers));
+                    });
+                }
+                return written;
+            }
+        }
+        throw std::runtime_error("invalid mode");
+    }
+
+    /// Send a file from the file cache. The file content does not get copied, HTTP gets it sent via sendfile(2) and
+    /// HTTP2 reads it from the mapping or, for streamed files, from disk.
+    ///
+    /// @param code The status code
+    /// @param f The file
+    /// @param offset The start of the part of the file to send
+    /// @param len The length of the part, npos sends everything after offset
+    void send_file(int code, const std::shared_ptr<file_cache::file>& f, std::size_t offset = 0,
+                   std::size_t len = std::string::npos) {
+        if (!response_header_exists("server")) {
+            add_header("server", "petrel");
+        }
+        len = std::min(len, f->size() - offset);
+        switch (m_mode) {
+            case mode::HTTP: {
+                auto& res = m_http_request->response;
+                if (!f->streamed()) {
+                    res.body_ref = f->data().substr(offset, len);
+                }
+                res.body_owner = f;
+                res.body_fd = f->fd();
+                res.body_fd_offset = offset;
+                res.body_fd_size = len;
+                res.status = code;
+                m_http_request->send_response();
+                break;
+            }
+            case mode::HTTP2: {
+                auto body = f->streamed() ? std::make_shared<http2_body>(f->fd(), offset, len)
+                                          : std::make_shared<http2_body>(f->data().substr(offset, len));
+                send_http2_body(code, body, f);
+                break;
+            }
+        }
+    }
+
+    /// Send a response with a body made of several parts without copying them.
+    ///
+    /// @param code The status code
+    /// @param parts The body parts
+    /// @param owner Keeps the memory of the parts alive until the response has been sent
+    void send_parts(int code, std::vector<boost::string_ref> parts, std::shared_ptr<const void> owner) {
+        if (!response_header_exists("server")) {
+            add_header("server", "petrel");
+        }
+        switch (m_mode) {
+            case mode::HTTP: {
+                auto& res = m_http_request->response;
+                res.body_parts = std::move(parts);
+                res.body_owner = owner;
+                res.status = code;
+                m_http_request->send_response();
+                break;
+            }
+            case mode::HTTP2: {
+                send_http2_body(code, std::make_shared<http2_body>(std::move(parts)), owner);
+                break;
+            }
+        }
+    }
+
+    /// Send a chunk of a streaming response. The first call sends the status and the headers that have been added so
+    /// far. Blocks the calling fiber if too many chunks are pending.
+    ///
+    /// @param code The status code, only used by the first call
+    /// @param chunk The data
+    /// @return false if the client is gone
+    bool write_chunk(int code, boost::string_ref chunk) {
+        if (!m_chunked) {
+            start_chunks(code);
+        }
+        switch (m_mode) {
+            case mode::HTTP:
+                return m_http_request->send_chunk(std::string(chunk.data(), chunk.size()));
+            case mode::HTTP2: {
+                auto& c = m_http2->chunks;
+                std::unique_lock<bf::mutex> lock(c->mtx);
+                c->cv.wait(lock, [&c] { return c->closed || c->chunks.size() < max_pending_chunks; });
+                if (c->closed) {
+                    return false;
+                }
+                c->chunks.emplace_back(chunk.data(), chunk.size());
+                bool resume = c->deferred;
+                c->deferred = false;
+                lock.unlock();
+                if (resume) {
+                    http2_resume(false);
+                }
+                return true;
+            }
+        }
+        throw std::runtime_error("invalid mode");
+    }
+
+    /// Finish a streaming response.
+    ///
+    /// @param abort If true, the client gets notified that the response is incomplete.
+    void finish_chunks(bool abort = false) {
+        if (!m_chunked) {
+            return;
+        }
+        switch (m_mode) {
+            case mode::HTTP:
+                m_http_request->finish_chunks(abort);
                 break;
+            case mode::HTTP2: {
+                auto& c = m_http2->chunks;
+                std::unique_lock<bf::mutex> lock(c->mtx);
+                if (c->finished) {
+                    return;
+                }
+                c->finished = true;
+                bool resume = c->deferred;
+                c->deferred = false;
+                lock.unlock();
+                if (resume || abort) {
+                    http2_resume(abort);
+                }
+                break;
+            }
         }
     }
 
+    /// Return true if a streaming response has been started via write_chunk
+    inline bool chunked() const { return m_chunked; }
+
   private:
+    /// Max number of chunks that can be pending for a HTTP2 streaming response
+    static constexpr std::size_t max_pending_chunks = 8;
+
+    /// The pending chunks of a HTTP2 streaming response. nghttp2 pulls them via a generator callback.
+    struct http2_chunks {
+        bf::mutex mtx;
+        bf::condition_variable cv;
+        std::deque<std::string> chunks;
+        std::size_t offset = 0;  // read position in the first chunk
+        bool finished = false;   // all chunks have been queued
+        bool closed = false;     // the stream has been closed
+        bool deferred = false;   // the generator ran out of data and has to be resumed
+
+        /// Mark the stream as closed and wake up the writer
+        void close() {
+            {
+                std::lock_guard<bf::mutex> lock(mtx);
+                closed = true;
+            }
+            cv.notify_all();
+        }
+
+        /// The generator callback
+        ssize_t read(std::uint8_t* buf, std::size_t len, std::uint32_t* flags) {
+            std::lock_guard<bf::mutex> lock(mtx);
+            std::size_t n = 0;
+            while (n < len && !chunks.empty()) {
+                auto& front = chunks.front();
+                auto cnt = std::min(len - n, front.size() - offset);
+                std::copy_n(front.data() + offset, cnt, buf + n);
+                n += cnt;
+                offset += cnt;
+                if (offset == front.size()) {
+                    chunks.pop_front();
+                    offset = 0;
+                }
+            }
+            if (n > 0) {
+                cv.notify_all();
+            }
+            if (chunks.empty() && finished) {
+                *flags |= NGHTTP2_DATA_FLAG_EOF;
+            } else if (n == 0) {
+                deferred = true;
+                return NGHTTP2_ERR_DEFERRED;
+            }
+            return n;
+        }
+    };
+
+    /// Send the head of a streaming response
+    void start_chunks(int code) {
+        m_chunked = true;
+        if (!response_header_exists("server")) {
+            add_header("server", "petrel");
+        }
+        switch (m_mode) {
+            case mode::HTTP:
+                m_http_request->start_chunks(code);
+                break;
+            case mode::HTTP2: {
+                auto c = std::make_shared<http2_chunks>();
+                m_http2->chunks = c;
+                auto headers = std::make_shared<http2::header_map>(std::move(m_http2->headers));
+                auto& res = m_http2->response;
+                auto stream = m_http2->stream;
+                http2_dispatch([&res, stream, code, headers, c] {
+                    // the close callback of the stream marks the chunks as closed
+                    stream->chunks = c;
+                    if (stream->closed) {
+                        c->close();
+                        return;
+                    }
+                    res.write_head(code, std::move(*headers));
+                    res.end([c](std::uint8_t* buf, std::size_t len, std::uint32_t* flags) {
+                        return c->read(buf, len, flags);
+                    });
+                });
+                break;
+            }
+        }
+    }
+
+    /// Resume the generator of a HTTP2 streaming response after new data has been queued or cancel the stream
+    void http2_resume(bool cancel) {
+        auto c = m_http2->chunks;
+        auto& res = m_http2->response;
+        http2_dispatch([&res, c, cancel] {
+            // the stream is gone if it has been closed already
+            if (!c->closed) {
+                if (cancel) {
+                    res.cancel(NGHTTP2_INTERNAL_ERROR);
+                } else {
+                    res.resume();
+                }
+            }
+        });
+    }
+
+    /// Send a HTTP2 response with a body that is owned by owner
+    void send_http2_body(int code, std::shared_ptr<http2_body> body, std::shared_ptr<const void> owner) {
+        std::size_t size = body->fd_remaining;
+        for (auto& p : body->parts) {
+            size += p.size();
+        }
+        add_header("content-length", std::to_string(size));
+        body->owner = owner;
+        auto headers = std::make_shared<http2::header_map>(std::move(m_http2->headers));
+        auto& res = m_http2->response;
+        auto stream = m_http2->stream;
+        http2_dispatch(
+            [&res, stream, code, headers, body] { http2_body::send(body, res, *stream, code, std::move(*headers)); });
+    }
+
+    /// Run a function that accesses the nghttp2 response. nghttp2 is not thread safe, so this has to be done by the
+    /// thread running the stream's io_service, see send_response.
+    template <typename F>
+    void http2_dispatch(F&& f) {
+        if (likely(std::this_thread::get_id() == m_http2->thread_id)) {
+            f();
+        } else {
+            m_http2->response.io_service().post(std::forward<F>(f));
+        }
+    }
+
+    /// A HTTP2 response body that is owned by the caller of send_response_nocopy or by the owner member. nghttp2
+    /// pulls the data via a generator callback. The body is either made of parts in memory or of a part of a file
+    /// that gets read on demand.
+    struct http2_body {
+        explicit http2_body(boost::string_ref c) : parts{c} {}
+        explicit http2_body(std::vector<boost::string_ref> p) : parts(std::move(p)) {}
+        http2_body(int f, std::size_t off, std::size_t len) : fd(f), fd_offset(off), fd_remaining(len) {}
+        std::vector<boost::string_ref> parts;
+        int fd = -1;                   // the file to read from, if not negative
+        std::size_t fd_offset = 0;     // read position in the file
+        std::size_t fd_remaining = 0;  // bytes left to read from the file
+        std::shared_ptr<const void> owner;  // keeps the content alive, if set
+        std::size_t part = 0;               // the part to read from
+        std::size_t offset = 0;             // read position in the part
+        bool done = false;
+        bf::promise<void> written;
+
+        void finish() {
+            if (!done) {
+                done = true;
+                written.set_value();
+            }
+        }
+
+        static void send(std::shared_ptr<http2_body> body, const http2::server::response& res, http2_stream& stream,
+                         int code, http2::header_map headers) {
+            if (stream.closed) {
+                body->finish();
+                return;
+            }
+            // the stream might get closed before all data has been pulled, its close callback finishes the body
+            stream.response_body = body;
+            res.write_head(code, std::move(headers));
+            res.end([body](std::uint8_t* buf, std::size_t len, std::uint32_t* flags) -> ssize_t {
+                if (body->fd >= 0) {
+                    return read_file(*body, buf, len, flags);
+                }
+                std::size_t n = 0;
+                while (n < len && body->part < body->parts.size()) {
+                    auto& p = body->parts[body->part];
+                    auto cnt = std::min(len - n, p.size() - body->offset);
+                    std::copy_n(p.data() + body->offset, cnt, buf + n);
+                    n += cnt;
+                    body->offset += cnt;
+                    if (body->offset == p.size()) {
+                        ++body->part;
+                        body->offset = 0;
+                    }
+                }
+                if (body->part == body->parts.size()) {
+                    *flags |= NGHTTP2_DATA_FLAG_EOF;
+                    body->finish();
+                }
+                return n;
+            });
+        }
+
+        /// Read the next data of a file body
+        static ssize_t read_file(http2_body& body, std::uint8_t* buf, std::size_t len, std::uint32_t* flags) {
+            ssize_t n = 0;
+            if (body.fd_remaining > 0) {
+                do {
+                    n = ::pread(body.fd, buf, std::min(len, body.fd_remaining), body.fd_offset);
+                } while (n < 0 && errno == EINTR);
+                if (n <= 0) {
+                    // a read error or the file has been truncated, reset the stream
+                    body.finish();
+                    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+                }
+                body.fd_offset += n;
+                body.fd_remaining -= n;
+            }
+            if (0 == body.fd_remaining) {
+                *flags |= NGHTTP2_DATA_FLAG_EOF;
+                body.finish();
+            }
+            return n;
+        }
+    };
+
     mode m_mode;
     http_method m_method{http_method::OTHER};
+    std::time_t m_timestamp{std::time(nullptr)};
+    params_type m_params;
+    bool m_body_read = false;
+    bool m_chunked = false;
 
     // http1
     session::request_type::pointer m_http_request;
@@ -338,13 +806,17 @@ class request : boost::noncopyable {
     struct http2_data {
         http2_data(server& s, const http2::server::request& req, const http2::server::response& res,
                    std::shared_ptr<http2_content_buffer_type> cnt)
-            : srv(s), request(req), response(res), content(cnt) {}
+            : srv(s), request(req), response(res), content(cnt), thread_id(std::this_thread::get_id()) {}
         server& srv;
         const http2::server::request& request;
         const http2::server::response& response;
         http2::header_map headers;
         std::shared_ptr<http2_content_buffer_type> content;
+        http2_stream::pointer stream;
+        body_stream::pointer body;
+        std::shared_ptr<http2_chunks> chunks;
         std::string path;
+        std::thread::id thread_id;
     };
     std::unique_ptr<http2_data> m_http2;
 
@@ -10,29 +10,26 @@
 
 namespace petrel {
 
-resolver_cache::resolver_cache() {
+namespace {
+std::atomic<std::uint64_t> g_next_id{0};
+}
+
+resolver_cache::resolver_cache() : m_id(g_next_id++) {
     m_ttl = options::opts["server.dns-cache-ttl"].as<int>();
+    m_negative_ttl = options::get_int("server.dns-cache-negative-ttl", 10);
     log_info("using DNS cache TTL of " << m_ttl << " minutes");
+    m_tcp_cache = std::make_shared<tcp_cache>(std::chrono::minutes(m_ttl), std::chrono::seconds(m_negative_ttl));
+    m_udp_cache = std::make_shared<udp_cache>(std::chrono::minutes(m_ttl), std::chrono::seconds(m_negative_ttl));
 }
 
 template <>
-resolver_cache::tcp_cache& resolver_cache::get_cache<resolver_cache::tcp>() {
+std::shared_ptr<resolver_cache::tcp_cache>& resolver_cache::get_cache<resolver_cache::tcp>() {
     return m_tcp_cache;
 }
 
 template <>
-resolver_cache::udp_cache& resolver_cache::get_cache<resolver_cache::udp>() {
+std::shared_ptr<resolver_cache::udp_cache>& resolver_cache::get_cache<resolver_cache::udp>() {
     return m_udp_cache;
 }
 
-template <>
-std::mutex& resolver_cache::get_cache_mtx<resolver_cache::tcp>() {
-    return m_tcp_cache_mtx;
-}
-
-template <>
-std::mutex& resolver_cache::get_cache_mtx<resolver_cache::udp>() {
-    return m_udp_cache_mtx;
-}
-
 }  // petrel
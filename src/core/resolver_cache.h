@@ -8,7 +8,10 @@
 #ifndef RESOLVER_CACHE_H
 #define RESOLVER_CACHE_H
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <exception>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -16,6 +19,7 @@
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/fiber/all.hpp>
 
 #include <petrel/core/log.h>
 #include <petrel/fiber/yield.hpp>
@@ -23,25 +27,54 @@
 namespace petrel {
 
 /// Cache for boosts asio resolver
+///
+/// Lookups hit a thread local cache first, the shared cache is only locked if the thread local entry expired. Only
+/// one fiber resolves a key at a time, other fibers wait for its result. Expired entries are served for another TTL
+/// while a background fiber refreshes them. Failed lookups are cached for the negative TTL.
 class resolver_cache {
   public:
     set_log_tag_default_priority("resolver_cache");
 
-    /// Cache entry
+    using clock = std::chrono::steady_clock;
+
+    /// Cache entry, entries are immutable once they have been added to the cache
     template <typename entry_type>
     struct entry_t {
-        std::chrono::system_clock::time_point expires;
         std::vector<entry_type> entries;
+        /// Set if the lookup failed
+        boost::system::error_code error;
+        /// The entry gets refreshed after it expired, until then it is fresh
+        clock::time_point expires;
+        /// Expired entries are served until they are stale
+        clock::time_point stale;
     };
 
     /// Cache class
     template <typename proto_type>
-    class cache : public std::unordered_map<std::string, entry_t<boost::asio::ip::basic_endpoint<proto_type>>> {
+    class cache {
       public:
         using entry = entry_t<boost::asio::ip::basic_endpoint<proto_type>>;
+        using entry_ptr = std::shared_ptr<const entry>;
         using resolver = boost::asio::ip::basic_resolver<proto_type>;
         using resolver_iterator = typename resolver::iterator;
         using query = typename resolver::query;
+
+        struct slot {
+            entry_ptr current;
+            /// Valid while a lookup is running, other fibers wait for it instead of sending their own query
+            boost::fibers::shared_future<entry_ptr> pending;
+            /// No background refresh gets started before this time, it is set if a refresh failed
+            clock::time_point retry_after;
+        };
+
+        cache(clock::duration ttl, clock::duration negative_ttl) : ttl(ttl), negative_ttl(negative_ttl) {}
+
+        const clock::duration ttl;
+        const clock::duration negative_ttl;
+        std::mutex mtx;
+        std::unordered_map<std::string, slot> slots;
+        /// The number of DNS queries
+        std::atomic<std::size_t> lookups{0};
     };
 
     using tcp = boost::asio::ip::tcp;
@@ -54,61 +87,206 @@ class resolver_cache {
 
     /// This method behaves like the basic_resolver version. It checks the cache first, does a DNS lookup on a miss and
     /// updates the cache afterwards.
+    ///
+    /// @param deadline The caller stops waiting for the lookup at this time and gets a timed_out error, the lookup
+    ///                 itself completes for the other callers
     template <typename proto_type>
-    const typename cache<proto_type>::resolver_iterator async_resolve(boost::asio::io_service& iosvc,
-                                                                      const std::string& host,
-                                                                      const std::string& service,
-                                                                      boost::fibers::asio::yield_t yield) {
-        using iterator = typename cache<proto_type>::resolver_iterator;
-        using query = typename cache<proto_type>::query;
-        using resolver = typename cache<proto_type>::resolver;
-        using entry = typename cache<proto_type>::entry;
-
-        auto& cache = get_cache<proto_type>();
-        auto& mtx = get_cache_mtx<proto_type>();
+    const typename cache<proto_type>::resolver_iterator async_resolve(
+        boost::asio::io_service& iosvc, const std::string& host, const std::string& service,
+        boost::fibers::asio::yield_t yield, clock::time_point deadline = clock::time_point::max()) {
         std::string key = host + ":" + service;
-        auto now = std::chrono::system_clock::now();
+        auto now = clock::now();
+
+        // check the thread local cache first, it needs no lock
+        auto& local = get_local_cache<proto_type>();
+        auto iter = local.find(key);
+        if (iter != local.end() && iter->second->expires > now) {
+            return make_iterator<proto_type>(*iter->second, host, service, yield);
+        }
+
+        auto e = lookup<proto_type>(iosvc, key, host, service, now, deadline);
+        if (e->expires > now) {
+            local[key] = e;
+        } else if (iter != local.end()) {
+            local.erase(iter);
+        }
+        return make_iterator<proto_type>(*e, host, service, yield);
+    }
 
-        // check the cache first
+    /// Return the number of DNS queries that have been sent
+    template <typename proto_type>
+    std::size_t lookups() {
+        return get_cache<proto_type>()->lookups;
+    }
+
+  private:
+    int m_ttl;
+    int m_negative_ttl;
+    /// Identifies the thread local caches of this object
+    std::uint64_t m_id;
+    std::shared_ptr<tcp_cache> m_tcp_cache;
+    std::shared_ptr<udp_cache> m_udp_cache;
+
+    template <typename proto_type>
+    std::shared_ptr<cache<proto_type>>& get_cache();
+
+    template <typename proto_type>
+    using local_cache = std::unordered_map<std::string, typename cache<proto_type>::entry_ptr>;
+
+    template <typename proto_type>
+    local_cache<proto_type>& get_local_cache() {
+        static thread_local std::unordered_map<std::uint64_t, local_cache<proto_type>> caches;
+        return caches[m_id];
+    }
+
+    /// Return the entry of the shared cache. Fresh and stale entries are returned right away, stale entries get
+    /// refreshed in the background. Otherwise the calling fiber waits for the lookup of the key until the deadline.
+    template <typename proto_type>
+    typename cache<proto_type>::entry_ptr lookup(boost::asio::io_service& iosvc, const std::string& key,
+                                                 const std::string& host, const std::string& service,
+                                                 clock::time_point now, clock::time_point deadline) {
+        using entry_ptr = typename cache<proto_type>::entry_ptr;
+        auto c = get_cache<proto_type>();
+        boost::fibers::shared_future<entry_ptr> pending;
         {
-            std::lock_guard<std::mutex> lock(mtx);
-            auto iter = cache.find(key);
-            if (iter != cache.end() && iter->second.expires > now) {
-                return iterator::create(iter->second.entries.begin(), iter->second.entries.end(), host, service);
+            std::lock_guard<std::mutex> lock(c->mtx);
+            auto& s = c->slots[key];
+            if (s.current && s.current->expires > now) {
+                return s.current;
             }
-            if (iter != cache.end()) {
-                // expired
-                cache.erase(iter);
+            if (s.current && !s.current->error && s.current->stale > now) {
+                if (!s.pending.valid() && s.retry_after <= now) {
+                    // refresh in the background and serve the stale entry meanwhile
+                    start_lookup<proto_type>(c, s, iosvc, key, host, service);
+                }
+                return s.current;
             }
+            if (!s.pending.valid()) {
+                start_lookup<proto_type>(c, s, iosvc, key, host, service);
+            }
+            pending = s.pending;
+        }
+        if (clock::time_point::max() != deadline &&
+            boost::fibers::future_status::timeout == pending.wait_until(deadline)) {
+            return timed_out<proto_type>();
         }
+        return pending.get();
+    }
 
-        // cache miss or entry expired, do a dns lookup now
-        log_debug("cache miss for " << host << ":" << service);
+    /// Resolve a key on a fiber of its own, so a caller can stop waiting for it without canceling the lookup for the
+    /// others. The caller has to hold the lock of the cache.
+    template <typename proto_type>
+    static void start_lookup(const std::shared_ptr<cache<proto_type>>& c, typename cache<proto_type>::slot& s,
+                             boost::asio::io_service& iosvc, const std::string& key, const std::string& host,
+                             const std::string& service) {
+        using entry_ptr = typename cache<proto_type>::entry_ptr;
+        auto promise = std::make_shared<boost::fibers::promise<entry_ptr>>();
+        s.pending = promise->get_future().share();
+        boost::fibers::fiber([c, promise, &iosvc, key, host, service] {
+            try {
+                publish<proto_type>(c, key, resolve<proto_type>(*c, iosvc, host, service), *promise);
+            } catch (...) {
+                // a stale entry is served until the negative TTL has passed, the waiting fibers get the exception
+                abandon<proto_type>(c, key, *promise);
+            }
+        }).detach();
+    }
+
+    /// Return an entry for a caller that stopped waiting for a lookup, it does not get cached
+    template <typename proto_type>
+    static typename cache<proto_type>::entry_ptr timed_out() {
+        auto e = std::make_shared<typename cache<proto_type>::entry>();
+        e->error = boost::asio::error::timed_out;
+        e->expires = e->stale = clock::now();
+        return e;
+    }
+
+    /// Send a DNS query, errors are returned as part of the entry
+    template <typename proto_type>
+    static typename cache<proto_type>::entry_ptr resolve(cache<proto_type>& c, boost::asio::io_service& iosvc,
+                                                         const std::string& host, const std::string& service) {
+        using iterator = typename cache<proto_type>::resolver_iterator;
+        using query = typename cache<proto_type>::query;
+        using resolver = typename cache<proto_type>::resolver;
+        using entry = typename cache<proto_type>::entry;
+
+        ++c.lookups;
+        auto e = std::make_shared<entry>();
         query q(host, service);
         resolver r(iosvc);
-        auto iter = r.async_resolve(q, yield);
-        auto ret = iter;
-        entry e;
-        e.expires = now + std::chrono::minutes(5);
-        for (; iter != iterator(); iter++) {
-            e.entries.push_back(*iter);
+        auto iter = r.async_resolve(q, boost::fibers::asio::yield[e->error]);
+        auto now = clock::now();
+        if (e->error == boost::asio::error::operation_aborted) {
+            // do not cache a canceled lookup
+            e->expires = now;
+        } else if (e->error) {
+            e->expires = now + c.negative_ttl;
+        } else {
+            for (; iter != iterator(); iter++) {
+                e->entries.push_back(*iter);
+            }
+            e->expires = now + c.ttl;
         }
-        std::lock_guard<std::mutex> lock(mtx);
-        cache[key] = std::move(e);
-        return ret;
+        e->stale = e->expires + c.ttl;
+        return e;
     }
 
-  private:
-    int m_ttl;
-    tcp_cache m_tcp_cache;
-    std::mutex m_tcp_cache_mtx;
-    udp_cache m_udp_cache;
-    std::mutex m_udp_cache_mtx;
+    /// Add the result of a lookup to the cache and pass it to the waiting fibers
+    template <typename proto_type>
+    static void publish(const std::shared_ptr<cache<proto_type>>& c, const std::string& key,
+                        const typename cache<proto_type>::entry_ptr& e,
+                        boost::fibers::promise<typename cache<proto_type>::entry_ptr>& promise) {
+        {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            auto& s = c->slots[key];
+            // keep serving a stale entry, if the refresh failed
+            auto now = clock::now();
+            bool keep = e->error && s.current && !s.current->error && s.current->stale > now;
+            if (keep) {
+                // do not query again for every request while the resolver fails
+                s.retry_after = now + c->negative_ttl;
+            } else if (e->expires > now) {
+                s.current = e;
+                s.retry_after = clock::time_point();
+            }
+            s.pending = boost::fibers::shared_future<typename cache<proto_type>::entry_ptr>();
+        }
+        promise.set_value(e);
+    }
 
+    /// Drop a lookup that threw an exception and pass the exception to the waiting fibers. Must be called from within
+    /// the catch block.
     template <typename proto_type>
-    cache<proto_type>& get_cache();
+    static void abandon(const std::shared_ptr<cache<proto_type>>& c, const std::string& key,
+                        boost::fibers::promise<typename cache<proto_type>::entry_ptr>& promise) {
+        {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            auto& s = c->slots[key];
+            s.retry_after = clock::now() + c->negative_ttl;
+            s.pending = boost::fibers::shared_future<typename cache<proto_type>::entry_ptr>();
+        }
+        promise.set_exception(std::current_exception());
+    }
+
+    /// Create the iterator for an entry or report its error like asio does
     template <typename proto_type>
-    std::mutex& get_cache_mtx();
+    static typename cache<proto_type>::resolver_iterator make_iterator(const typename cache<proto_type>::entry& e,
+                                                                       const std::string& host,
+                                                                       const std::string& service,
+                                                                       boost::fibers::asio::yield_t yield) {
+        using iterator = typename cache<proto_type>::resolver_iterator;
+        if (e.error) {
+            if (nullptr == yield.ec_) {
+                throw boost::system::system_error(e.error);
+            }
+            *yield.ec_ = e.error;
+            return iterator();
+        }
+        if (nullptr != yield.ec_) {
+            yield.ec_->clear();
+        }
+        return iterator::create(e.entries.begin(), e.entries.end(), host, service);
+    }
 };
 
 }  // petrel
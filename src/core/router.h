@@ -10,11 +10,16 @@
 
 #include <algorithm>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include <nghttp2/asio_http2_server.h>
 
 #include "boost/http/message.hpp"
 #include "boost/http/status_code.hpp"
+#include "branch.h"
 #include "request.h"
 
 namespace petrel {
@@ -22,67 +27,224 @@ namespace petrel {
 namespace http = boost::http;
 namespace http2 = nghttp2::asio_http2;
 
-/// A set like struct that is indexing a string by character
+/// A set like struct that is indexing strings in a compressed radix tree. Each edge holds a string of one or more
+/// characters and a node can be a terminal node, which means that the path up to the node has been inserted.
+///
+/// Paths can contain parameters like /users/:id/orders. A parameter matches one path segment (up to the next '/' or
+/// '?') and is stored in a separate param child of the node the parameter follows. Literal edges take precedence over
+/// parameters.
 template <typename Node>
 class path_set {
   public:
     using node_type = Node;
     using func_type = typename node_type::func_type;
+    using params_type = std::vector<std::pair<std::string, std::string>>;
 
-    node_type& insert(const std::string& path, func_type func) {
-        auto* next = root;
-        for (std::size_t i = 0; i < path.length(); ++i) {
-            std::uint8_t c = path[i];
-            auto& node = next[c];
-            if (i == path.length() - 1) {
-                node.term = true;
-                node.func = func;
-                return node;
-            } else {
-                if (nullptr == node.next) {
-                    node.next = new node_type[256];
-                }
-                next = node.next;
+    /// Insert a path.
+    ///
+    /// @param path The path, optionally containing parameters
+    /// @param func The function to store
+    /// @param method If not empty, the function will only be found for this method
+    node_type& insert(const std::string& path, func_type func, const std::string& method = "") {
+        if (path.empty()) {
+            throw std::runtime_error("insert failed");
+        }
+        auto* node = &m_root;
+        std::size_t pos = 0;
+        while (pos < path.length()) {
+            auto param_pos = find_param(path, pos);
+            node = insert_literal(node, path, pos, param_pos);
+            if (param_pos == path.length()) {
+                break;
+            }
+            auto param_end = std::min(path.find('/', param_pos), path.length());
+            std::string name = path.substr(param_pos + 1, param_end - param_pos - 1);
+            if (name.empty()) {
+                throw std::runtime_error("insert failed: empty parameter name in " + path);
             }
+            if (nullptr == node->param_child) {
+                node->param_child.reset(new node_type);
+                node->param_child->param_name = name;
+            } else if (node->param_child->param_name != name) {
+                throw std::runtime_error("insert failed: conflicting parameter names in " + path);
+            }
+            node = node->param_child.get();
+            pos = param_end;
         }
-        throw std::runtime_error("insert failed");
+        node->set_func(std::move(func), method);
+        return *node;
     }
 
-    func_type& find(const std::string& path) {
-        auto* next = root;
-        node_type* found = nullptr;
-        for (std::size_t i = 0; i < path.length(); ++i) {
-            std::uint8_t c = path[i];
-            auto& node = next[c];
-            if (node.term) {
-                found = &node;
-            }
-            if (nullptr == node.next) {
-                break;
+    /// Find the function for the longest inserted prefix of path.
+    ///
+    /// @param path The path to look up
+    /// @param method The request method, functions inserted without a method match any method
+    /// @param params If not nullptr, the captured parameters of the match get stored here
+    /// @return A pointer to the function or nullptr if no prefix of path has been inserted
+    func_type* find(const std::string& path, const std::string& method = "", params_type* params = nullptr) {
+        match_result best;
+        params_type captures;
+        match(&m_root, path, 0, method, captures, best);
+        if (nullptr != best.func && nullptr != params) {
+            *params = std::move(best.params);
+        }
+        return best.func;
+    }
+
+  private:
+    node_type m_root;
+
+    struct match_result {
+        func_type* func = nullptr;
+        std::size_t len = 0;
+        params_type params;
+    };
+
+    /// Return the position of the next parameter (a ':' at the start of a segment) or the length of path.
+    static std::size_t find_param(const std::string& path, std::size_t pos) {
+        for (auto i = pos; i < path.length(); ++i) {
+            if (path[i] == ':' && (i == 0 || path[i - 1] == '/')) {
+                return i;
             }
-            next = node.next;
         }
-        if (nullptr != found) {
-            return found->func;
+        return path.length();
+    }
+
+    /// Insert path[pos, end) below node and return the node at the end.
+    static node_type* insert_literal(node_type* node, const std::string& path, std::size_t pos, std::size_t end) {
+        while (pos < end) {
+            auto idx = node->find_child(path[pos]);
+            if (node_type::npos == idx) {
+                // no edge for the next char, add the rest as new node
+                return &node->add_child(path.substr(pos, end - pos));
+            }
+            auto* child = node->children[idx].get();
+            auto& prefix = child->prefix;
+            std::size_t len = 1;
+            while (len < prefix.length() && pos + len < end && prefix[len] == path[pos + len]) {
+                ++len;
+            }
+            if (len < prefix.length()) {
+                // the path diverges inside the edge, so we split it
+                child = node->split_child(idx, len);
+            }
+            node = child;
+            pos += len;
         }
-        throw std::runtime_error("find failed");
+        return node;
     }
 
-  private:
-    node_type root[256];
+    /// Walk the tree and remember the longest match. Literal edges are tried before parameters.
+    static void match(node_type* node, const std::string& path, std::size_t pos, const std::string& method,
+                      params_type& captures, match_result& best) {
+        if (node->term && (nullptr == best.func || pos > best.len)) {
+            auto* func = node->get_func(method);
+            if (nullptr != func) {
+                best.func = func;
+                best.len = pos;
+                best.params = captures;
+            }
+        }
+        if (pos == path.length()) {
+            return;
+        }
+        auto idx = node->find_child(path[pos]);
+        if (node_type::npos != idx) {
+            auto* child = node->children[idx].get();
+            if (path.compare(pos, child->prefix.length(), child->prefix) == 0) {
+                match(child, path, pos + child->prefix.length(), method, captures, best);
+            }
+        }
+        if (unlikely(nullptr != node->param_child) && (pos == 0 || path[pos - 1] == '/')) {
+            auto end = std::min(path.find_first_of("/?", pos), path.length());
+            if (end > pos) {
+                captures.emplace_back(node->param_child->param_name, path.substr(pos, end - pos));
+                match(node->param_child.get(), path, end, method, captures, best);
+                captures.pop_back();
+            }
+        }
+    }
 };
 
 /// A node in the search set.
 template <typename Func>
 struct path_node {
     using func_type = Func;
+    using pointer = std::unique_ptr<path_node>;
+
+    static constexpr std::size_t npos = std::string::npos;
+
+    /// The edge label leading to this node
+    std::string prefix;
     bool term = false;
+    /// The function for any method
     func_type func;
-    path_node* next = nullptr;
-    ~path_node() {
-        if (nullptr != next) {
-            delete[] next;
+    bool any_method = false;
+    /// Functions for specific methods
+    std::vector<std::pair<std::string, func_type>> method_funcs;
+    /// The first characters of the child edges, kept in one contiguous string for a cache friendly child lookup
+    std::string keys;
+    std::vector<pointer> children;
+    /// The parameter child and its name, if a parameter follows this node
+    pointer param_child;
+    std::string param_name;
+
+    /// Return the index of the child whose edge starts with c or npos.
+    inline std::size_t find_child(char c) const {
+        for (std::size_t i = 0; i < keys.length(); ++i) {
+            if (keys[i] == c) {
+                return i;
+            }
+        }
+        return npos;
+    }
+
+    /// Return the function for a method or nullptr
+    inline func_type* get_func(const std::string& method) {
+        for (auto& mf : method_funcs) {
+            if (mf.first == method) {
+                return &mf.second;
+            }
         }
+        return any_method ? &func : nullptr;
+    }
+
+    /// Set the function for a method (any method if empty)
+    void set_func(func_type f, const std::string& method) {
+        term = true;
+        if (method.empty()) {
+            func = std::move(f);
+            any_method = true;
+            return;
+        }
+        for (auto& mf : method_funcs) {
+            if (mf.first == method) {
+                mf.second = std::move(f);
+                return;
+            }
+        }
+        method_funcs.emplace_back(method, std::move(f));
+    }
+
+    /// Add a child node
+    path_node& add_child(std::string p) {
+        pointer child(new path_node);
+        child->prefix = std::move(p);
+        keys += child->prefix[0];
+        children.push_back(std::move(child));
+        return *children.back();
+    }
+
+    /// Split the edge to the child at index idx after len characters and return the new intermediate node.
+    path_node* split_child(std::size_t idx, std::size_t len) {
+        pointer mid(new path_node);
+        auto& child = children[idx];
+        mid->prefix = child->prefix.substr(0, len);
+        child->prefix.erase(0, len);
+        mid->keys += child->prefix[0];
+        mid->children.push_back(std::move(child));
+        children[idx] = std::move(mid);
+        return children[idx].get();
     }
 };
 
@@ -90,6 +252,7 @@ struct path_node {
 class router {
   public:
     using route_func_type = std::function<void(request::pointer)>;
+    using params_type = request::params_type;
 
     router() {
         // 404 default
@@ -97,16 +260,33 @@ class router {
     }
 
     /// Add a route function for a path. All incoming requests starting with the given path string will be handled by
-    /// the given function.
-    void add_route(const std::string& path, route_func_type func) { m_set.insert(path, std::move(func)); }
+    /// the given function. The path can contain parameters like /users/:id/orders.
+    ///
+    /// @param path The path
+    /// @param func The route function
+    /// @param method If not empty, the route will only be used for requests with this method
+    void add_route(const std::string& path, route_func_type func, const std::string& method = "") {
+        m_set.insert(path, std::move(func), method);
+    }
+
+    /// Find a route function for a path.
+    ///
+    /// @param path The request path
+    /// @param method The request method
+    /// @param params If not nullptr, the captured path parameters get stored here
+    /// @return A pointer to the function or nullptr if no route matches
+    route_func_type* find(const std::string& path, const std::string& method = "", params_type* params = nullptr) {
+        return m_set.find(path, method, params);
+    }
 
     /// Find a route function for a path. A default function will be returned if no function can be found.
-    route_func_type& find_route(const std::string& path) {
-        try {
-            return m_set.find(path);
-        } catch (std::runtime_error&) {
-            return m_default_func;
+    route_func_type& find_route(const std::string& path, const std::string& method = "",
+                                params_type* params = nullptr) {
+        auto* func = m_set.find(path, method, params);
+        if (likely(nullptr != func)) {
+            return *func;
         }
+        return m_default_func;
     }
 
   private:
@@ -5,7 +5,11 @@
  * Author: Andreas Pohl
  */
 
+#include <algorithm>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/fiber/all.hpp>
+#include <cstdio>
+#include <cstdlib>
 #include <petrel/fiber/yield.hpp>
 #include <random>
 #include <unistd.h>
@@ -26,6 +30,9 @@ namespace bs = boost::system;
 namespace bpo = boost::program_options;
 namespace bfa = bf::asio;
 
+/// Max number of bytes we reserve for a HTTP/2 request body based on the content-length header
+constexpr std::size_t max_content_reserve = 16 * 1024 * 1024;
+
 /// Thread safe int rand
 std::uint16_t int_rand(std::uint16_t min, std::uint16_t max) {
     static thread_local std::unique_ptr<std::minstd_rand> gen;
@@ -36,7 +43,12 @@ std::uint16_t int_rand(std::uint16_t min, std::uint16_t max) {
     return dist(*gen);
 }
 
-server_impl::server_impl(server* srv) : m_server(srv), m_registry(m_resolver_cache) {
+server_impl::server_impl(server* srv)
+    : m_server(srv),
+      m_registry(m_resolver_cache),
+      m_file_cache(5, static_cast<std::size_t>(options::get_int("files.cache-size", 256)) * 1024 * 1024,
+                   static_cast<std::size_t>(options::get_int("files.stream-threshold", 1024)) * 1024),
+      m_fiber_cache(options::is_set("server.work-stealing")) {
     m_num_workers = options::get_int("server.workers", 1);
     if (m_num_workers == 0) {
         m_num_workers = sysconf(_SC_NPROCESSORS_ONLN);
@@ -44,11 +56,17 @@ server_impl::server_impl(server* srv) : m_server(srv), m_registry(m_resolver_cac
     if (m_num_workers < 1) {
         m_num_workers = 1;
     }
+    // the pipeline is a fiber channel, its capacity has to be a power of 2 and it can hold capacity - 1 requests
+    auto pipeline_depth = options::get_int("server.pipeline-depth", 16);
+    while (m_pipeline_capacity < static_cast<std::size_t>(pipeline_depth) + 1) {
+        m_pipeline_capacity <<= 1;
+    }
+    m_http2_stream_body = options::is_set("server.http2-stream-body");
     m_join_func = [] {};
     m_stop_func = [] {};
     m_metric_requests = m_registry.register_metric<metrics::meter>("requests");
     m_metric_errors = m_registry.register_metric<metrics::meter>("errors");
-    m_metric_errors = m_registry.register_metric<metrics::meter>("not_implemented");
+    m_metric_not_impl = m_registry.register_metric<metrics::meter>("not_implemented");
     m_metric_times = m_registry.register_metric<metrics::timer>("times");
 }
 
@@ -96,31 +114,44 @@ void server_impl::stop() {
 void server_impl::start_http2() {
     // install a handler that uses our own router
     m_http2_server->handle("/", [this](const http2::server::request& req, const http2::server::response& res) {
-        if (req.method() == "GET") {
-            auto& route = m_router.find_route(req.uri().raw_path);
-            route(std::make_shared<request>(req, res, *m_server, nullptr));
-        } else if (req.method() == "POST") {
+        // the close callback finishes whatever waits for the stream when it gets closed or reset
+        auto stream = request::http2_stream::attach(res);
+        // every method goes through the router, the route functions decide which methods they support
+        if (req.method() == "GET" || req.method() == "HEAD") {
+            // no body, route the request right away
+            auto r = std::make_shared<request>(req, res, *m_server, nullptr, stream);
+            auto& route = m_router.find_route(req.uri().raw_path, req.method(), &r->params());
+            route(r);
+        } else if (m_http2_stream_body) {
+            // route the request now and pass the body to the handler as it comes in
+            auto body = std::make_shared<request::body_stream>();
+            req.on_data([body](const uint8_t* data, std::size_t len) { body->push(data, len); });
+            // make sure the handler does not wait for more data forever if the stream gets reset
+            stream->body = body;
+            auto r = std::make_shared<request>(req, res, *m_server, nullptr, stream);
+            auto& route = m_router.find_route(req.uri().raw_path, req.method(), &r->params());
+            route(r);
+        } else {
             log_debug("receiving content body");
             auto buf = std::make_shared<request::http2_content_buffer_type>();
-            req.on_data([this, buf, &req, &res](const uint8_t* data, std::size_t len) {
+            auto it = req.header().find("content-length");
+            if (req.header().end() != it) {
+                // pre-size the buffer, but do not trust the client too much
+                auto len = std::strtoull(it->second.value.c_str(), nullptr, 10);
+                buf->reserve(std::min<std::size_t>(len, max_content_reserve));
+            }
+            req.on_data([this, buf, stream, &req, &res](const uint8_t* data, std::size_t len) {
                 if (len == 0) {
                     log_debug("received all content data");
                     // received all content, route the request now
-                    auto& route = m_router.find_route(req.uri().raw_path);
-                    route(std::make_shared<request>(req, res, *m_server, buf));
+                    auto r = std::make_shared<request>(req, res, *m_server, buf, stream);
+                    auto& route = m_router.find_route(req.uri().raw_path, req.method(), &r->params());
+                    route(r);
                 } else {
                     log_debug("received content chunk of " << len << " bytes");
-                    // resize the buffer if needed
-                    if (buf->capacity() - buf->size() < len) {
-                        buf->reserve(buf->capacity() + len + 1024);
-                    }
-                    std::copy(data, data + len, std::back_inserter(*buf));
+                    buf->insert(buf->end(), data, data + len);
                 }
             });
-        } else {
-            m_metric_not_impl->increment();
-            request r(req, res, *m_server, nullptr);
-            r.send_error_response(501);
         }
     });
     // Check for SSL
@@ -141,11 +172,22 @@ void server_impl::start_http() {
     tcp::resolver::query query(listen, port);
     bs::error_code ec;
     bool success = false;
-    // Create an acceptor for any address and protocol type (IPv6/IPv4)
+    bool reuse_port = options::is_set("server.reuseport");
+    // Create an acceptor for any address and protocol type (IPv6/IPv4). With SO_REUSEPORT every worker gets its own
+    // acceptor for each endpoint.
     for (auto it = resolver.resolve(query); it != tcp::resolver::iterator(); ++it) {
         tcp::endpoint ep = *it;
         bs::error_code ec_local;
-        get_worker().add_endpoint(ep, ec_local);
+        if (reuse_port) {
+            for (auto& w : m_workers) {
+                w->add_endpoint(ep, ec_local, true);
+                if (ec_local) {
+                    break;
+                }
+            }
+        } else {
+            get_worker().add_endpoint(ep, ec_local);
+        }
         if (ec_local) {
             ec = ec_local;
         } else {
@@ -176,15 +218,18 @@ void server_impl::start_http() {
     };
 }
 
-void server_impl::add_route(const std::string& path, const std::string& func) {
+void server_impl::add_route(const std::string& path, const std::string& func, const std::string& method) {
     auto metric_req = m_registry.register_metric<metrics::meter>("requests_" + func);
     auto metric_err = m_registry.register_metric<metrics::meter>("errors_" + func);
     auto metric_times = m_registry.register_metric<metrics::timer>("times_" + func);
-    m_router.add_route(path, [this, func, metric_req, metric_times, metric_err](request::pointer req) {
+    bool any_method = method.empty();
+    auto id = m_lua_engine.register_handler(func);
+    m_router.add_route(path, [this, id, any_method, metric_req, metric_times, metric_err](request::pointer req) {
         log_debug("incomong request: method=" << req->method_string() << " path='" << req->path()
-                                              << "' -> func=" << func);
-        // we support only GET/POST
-        if (req->method() == request::http_method::GET || req->method() == request::http_method::POST) {
+                                              << "' -> func=" << m_lua_engine.handler_name(id));
+        // we support only GET/POST, unless the route has been added for a specific method
+        if (!any_method || req->method() == request::http_method::GET ||
+            req->method() == request::http_method::POST) {
             // total requests
             m_metric_requests->increment();
             // path requests
@@ -200,14 +245,19 @@ void server_impl::add_route(const std::string& path, const std::string& func) {
             }
             try {
                 // create a fiber and run the request handler
-                m_fiber_cache.run([this, func, req, times, metric_err] {
+                m_fiber_cache.run([this, id, req, times, metric_err] {
                     try {
-                        m_lua_engine.handle_request(func, req);
+                        m_lua_engine.handle_request(id, req);
                     } catch (std::runtime_error& e) {
                         log_debug("handle_request failed: " << e.what());
                         m_metric_errors->increment();
                         metric_err->increment();
-                        req->send_error_response(500);
+                        if (req->chunked()) {
+                            // the status has been sent already
+                            req->finish_chunks(true);
+                        } else {
+                            req->send_error_response(500);
+                        }
                     }
                 });
             } catch (std::runtime_error& e) {
@@ -220,17 +270,279 @@ void server_impl::add_route(const std::string& path, const std::string& func) {
             m_metric_not_impl->increment();
             req->send_error_response(501);
         }
-    });
+    }, method);
     m_num_routes++;
-    log_info("  new route: " << path << " -> " << func);
+    log_info("  new route: " << (method.empty() ? "" : method + " ") << path << " -> " << func);
+}
+
+/// Return the best representation of a file for the Accept-Encoding header of a request and its content coding
+std::pair<std::shared_ptr<file_cache::file>, const char*> select_encoding(const request& req,
+                                                                         std::shared_ptr<file_cache::file> f) {
+    using encoding = file_cache::file::encoding;
+    auto& ae = req.header("accept-encoding");
+    if (ae.empty() || !f->has_variants()) {
+        return {f, nullptr};
+    }
+    // parse the codings and their q-values, codings that are not listed are covered by '*'
+    double q_gzip = -1, q_br = -1, q_any = 0;
+    boost::string_ref codings(ae);
+    while (!codings.empty()) {
+        auto pos = codings.find(',');
+        auto coding = codings.substr(0, pos);
+        double q = 1;
+        auto semi = coding.find(';');
+        if (semi != boost::string_ref::npos) {
+            auto qpos = coding.find("q=", semi);
+            if (qpos != boost::string_ref::npos) {
+                q = std::atof(coding.substr(qpos + 2).to_string().c_str());
+            }
+            coding = coding.substr(0, semi);
+        }
+        while (!coding.empty() && coding.front() == ' ') {
+            coding.remove_prefix(1);
+        }
+        while (!coding.empty() && coding.back() == ' ') {
+            coding.remove_suffix(1);
+        }
+        if (boost::algorithm::iequals(coding, "gzip") || boost::algorithm::iequals(coding, "x-gzip")) {
+            q_gzip = q;
+        } else if (boost::algorithm::iequals(coding, "br")) {
+            q_br = q;
+        } else if (coding == "*") {
+            q_any = q;
+        }
+        if (pos == boost::string_ref::npos) {
+            break;
+        }
+        codings.remove_prefix(pos + 1);
+    }
+    if (q_gzip < 0) {
+        q_gzip = q_any;
+    }
+    if (q_br < 0) {
+        q_br = q_any;
+    }
+    // prefer brotli as it compresses better
+    auto& br = f->variant(encoding::br);
+    auto& gz = f->variant(encoding::gzip);
+    if (nullptr != br && q_br > 0 && (nullptr == gz || q_br >= q_gzip)) {
+        return {br, "br"};
+    }
+    if (nullptr != gz && q_gzip > 0) {
+        return {gz, "gzip"};
+    }
+    return {f, nullptr};
+}
+
+/// Return true if the client has a valid copy of a file, so we can respond with 304 (see RFC 7232)
+///
+/// @param req The request
+/// @param etag The entity tag of the selected representation
+/// @param time The last write time of the file
+bool not_modified(const request& req, const std::string& etag, std::time_t time) {
+    auto& inm = req.header("if-none-match");
+    if (!inm.empty()) {
+        // weak comparison of a list of tags
+        boost::string_ref tags(inm);
+        while (!tags.empty()) {
+            auto pos = tags.find(',');
+            auto tag = tags.substr(0, pos);
+            while (!tag.empty() && tag.front() == ' ') {
+                tag.remove_prefix(1);
+            }
+            while (!tag.empty() && tag.back() == ' ') {
+                tag.remove_suffix(1);
+            }
+            if (tag.starts_with("W/")) {
+                tag.remove_prefix(2);
+            }
+            if (tag == "*" || tag == etag) {
+                return true;
+            }
+            if (pos == boost::string_ref::npos) {
+                break;
+            }
+            tags.remove_prefix(pos + 1);
+        }
+        // If-Modified-Since has to be ignored if If-None-Match is present
+        return false;
+    }
+    auto& ims = req.header("if-modified-since");
+    if (!ims.empty()) {
+        auto t = file_cache::from_http_date(ims);
+        return t >= 0 && time <= t;
+    }
+    return false;
+}
+
+/// A byte range (first and last byte)
+using byte_range = std::pair<std::size_t, std::size_t>;
+
+/// Max number of ranges we serve for a request, we ignore the Range header if a client asks for more
+constexpr std::size_t max_ranges = 16;
+
+/// Parse a Range header (see RFC 7233). Unsatisfiable ranges are skipped.
+///
+/// @param hdr The header value
+/// @param size The size of the representation
+/// @param ranges Receives the satisfiable ranges
+/// @return false if the header is invalid and should be ignored
+bool parse_ranges(const std::string& hdr, std::size_t size, std::vector<byte_range>& ranges) {
+    boost::string_ref specs(hdr);
+    if (!specs.starts_with("bytes=")) {
+        return false;
+    }
+    specs.remove_prefix(6);
+    std::size_t count = 0;
+    while (!specs.empty()) {
+        auto pos = specs.find(',');
+        auto spec = specs.substr(0, pos);
+        while (!spec.empty() && spec.front() == ' ') {
+            spec.remove_prefix(1);
+        }
+        while (!spec.empty() && spec.back() == ' ') {
+            spec.remove_suffix(1);
+        }
+        auto dash = spec.find('-');
+        if (dash == boost::string_ref::npos || ++count > max_ranges) {
+            return false;
+        }
+        auto first_str = spec.substr(0, dash);
+        auto last_str = spec.substr(dash + 1);
+        auto is_num = [](boost::string_ref s) {
+            return !s.empty() && s.size() < 20 &&
+                   std::all_of(s.begin(), s.end(), [](char c) { return c >= '0' && c <= '9'; });
+        };
+        if (first_str.empty()) {
+            // suffix range
+            if (!is_num(last_str)) {
+                return false;
+            }
+            auto len = std::stoull(last_str.to_string());
+            if (len > 0 && size > 0) {
+                ranges.emplace_back(size - std::min<std::size_t>(len, size), size - 1);
+            }
+        } else {
+            if (!is_num(first_str) || (!last_str.empty() && !is_num(last_str))) {
+                return false;
+            }
+            std::size_t first = std::stoull(first_str.to_string());
+            std::size_t last = last_str.empty() ? size - 1 : std::stoull(last_str.to_string());
+            if (last < first) {
+                return false;
+            }
+            if (first < size) {
+                ranges.emplace_back(first, std::min(last, size - 1));
+            }
+        }
+        if (pos == boost::string_ref::npos) {
+            break;
+        }
+        specs.remove_prefix(pos + 1);
+    }
+    return count > 0;
+}
+
+/// Return true if a Range header should be evaluated according to the If-Range header
+bool if_range_matches(const request& req, const std::string& etag, std::time_t time) {
+    auto& ir = req.header("if-range");
+    if (ir.empty()) {
+        return true;
+    }
+    if (ir.front() == '"') {
+        // strong comparison
+        return ir == etag;
+    }
+    if (boost::algorithm::starts_with(ir, "W/")) {
+        return false;
+    }
+    return file_cache::from_http_date(ir) == time;
+}
+
+/// The body of a multipart/byteranges response
+struct byteranges_body {
+    std::shared_ptr<file_cache::file> file;
+    std::vector<std::string> heads;
+};
+
+void server_impl::send_static_file(request& req, std::shared_ptr<file_cache::file> file,
+                                   const std::string& cache_control) {
+    auto sel = select_encoding(req, file);
+    auto& repr = sel.first;
+    if (nullptr != sel.second) {
+        req.add_header("content-encoding", sel.second);
+    }
+    if (file->has_variants()) {
+        req.add_header("vary", "accept-encoding");
+    }
+    req.add_header("etag", repr->etag());
+    req.add_header("last-modified", file->last_modified());
+    req.add_header("accept-ranges", "bytes");
+    if (!cache_control.empty()) {
+        req.add_header("cache-control", cache_control);
+    }
+    if (not_modified(req, repr->etag(), file->time())) {
+        req.send_response(304, boost::string_ref());
+        return;
+    }
+    auto& range = req.header("range");
+    std::vector<byte_range> ranges;
+    if (range.empty() || !if_range_matches(req, repr->etag(), file->time()) ||
+        !parse_ranges(range, repr->size(), ranges)) {
+        req.send_file(200, repr);
+        return;
+    }
+    auto total = "/" + std::to_string(repr->size());
+    if (ranges.empty()) {
+        req.add_header("content-range", "bytes *" + total);
+        req.send_error_response(416);
+        return;
+    }
+    auto content_range = [&total](const byte_range& r) {
+        return "bytes " + std::to_string(r.first) + "-" + std::to_string(r.second) + total;
+    };
+    if (ranges.size() == 1) {
+        auto& r = ranges.front();
+        req.add_header("content-range", content_range(r));
+        req.send_file(206, repr, r.first, r.second - r.first + 1);
+        return;
+    }
+    if (repr->streamed()) {
+        // we would have to read the parts from disk, ranges are optional, so send the whole file
+        req.send_file(200, repr);
+        return;
+    }
+    // multiple ranges, the parts are sent straight from the file
+    char boundary[20];
+    std::snprintf(boundary, sizeof(boundary), "%04x%04x%04x%04x", int_rand(0, 0xffff), int_rand(0, 0xffff),
+                  int_rand(0, 0xffff), int_rand(0, 0xffff));
+    req.add_header("content-type", std::string("multipart/byteranges; boundary=") + boundary);
+    auto body = std::make_shared<byteranges_body>();
+    body->file = repr;
+    body->heads.reserve(ranges.size() + 1);
+    for (auto& r : ranges) {
+        body->heads.push_back(std::string("\r\n--") + boundary + "\r\ncontent-range: " + content_range(r) +
+                              "\r\n\r\n");
+    }
+    body->heads.push_back(std::string("\r\n--") + boundary + "--\r\n");
+    std::vector<boost::string_ref> parts;
+    parts.reserve(ranges.size() * 2 + 1);
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        parts.push_back(body->heads[i]);
+        parts.push_back(repr->data().substr(ranges[i].first, ranges[i].second - ranges[i].first + 1));
+    }
+    parts.push_back(body->heads.back());
+    req.send_parts(206, std::move(parts), body);
 }
 
-void server_impl::add_directory_route(const std::string& path, const std::string& dir) {
+void server_impl::add_directory_route(const std::string& path, const std::string& dir,
+                                      const std::string& cache_control) {
     if (m_file_cache.add_directory(dir)) {
         auto metric_req = m_registry.register_metric<metrics::meter>("requests_static_files");
         auto metric_err = m_registry.register_metric<metrics::meter>("errors_static_files");
         auto metric_times = m_registry.register_metric<metrics::timer>("times_static_files");
-        m_router.add_route(path, [this, path, dir, metric_req, metric_times, metric_err](request::pointer req) {
+        m_router.add_route(path, [this, path, dir, cache_control, metric_req, metric_times,
+                                  metric_err](request::pointer req) {
             log_debug("incomong request: method=" << req->method_string() << " path='" << req->path()
                                                   << "' -> static_dir=" << dir);
             if (req->method() == request::http_method::GET) {
@@ -243,7 +555,7 @@ void server_impl::add_directory_route(const std::string& path, const std::string
                 }
                 auto file = find_static_file(dir, path, req->path());
                 if (nullptr != file) {
-                    req->send_response(200, boost::string_ref(file->data().data(), file->size()));
+                    send_static_file(*req, file, cache_control);
                     m_metric_requests->increment();
                     metric_req->increment();
                     return;
@@ -258,18 +570,111 @@ void server_impl::add_directory_route(const std::string& path, const std::string
     }
 }
 
+/// Max length of a normalized static file path, longer paths are not served
+constexpr std::size_t max_static_path = 1024;
+
+/// Return the value of a hex digit or -1
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/// Normalize the path of a static file relative to the route directory. The query is dropped, the path gets
+/// percent-decoded, empty and "." segments are removed and ".." segments are resolved.
+///
+/// @param in The path relative to the route
+/// @param buf Receives the normalized path
+/// @param size The size of buf
+/// @param out Is set to the normalized path in buf
+/// @return false if the path is invalid, too long or points outside of the directory
+bool normalize_static_path(boost::string_ref in, char* buf, std::size_t size, boost::string_ref& out) {
+    std::size_t len = 0;  // the length of the output
+    std::size_t seg = 0;  // the start of the current segment in the output
+    bool end = false;
+    for (std::size_t i = 0; !end; ++i) {
+        char c;
+        if (i == in.size() || in[i] == '?' || in[i] == '#') {
+            // finish the last segment
+            c = '/';
+            end = true;
+        } else if (in[i] == '%') {
+            if (i + 2 >= in.size()) {
+                return false;
+            }
+            auto hi = hex_value(in[i + 1]);
+            auto lo = hex_value(in[i + 2]);
+            if (hi < 0 || lo < 0 || (hi == 0 && lo == 0)) {
+                return false;
+            }
+            c = static_cast<char>(hi << 4 | lo);
+            i += 2;
+        } else {
+            c = in[i];
+        }
+        if (c != '/') {
+            if (len == size) {
+                return false;
+            }
+            buf[len++] = c;
+            continue;
+        }
+        boost::string_ref segment(buf + seg, len - seg);
+        if (segment.empty() || segment == ".") {
+            len = seg;
+        } else if (segment == "..") {
+            if (seg == 0) {
+                // outside of the directory
+                return false;
+            }
+            // drop the previous segment
+            len = seg - 1;
+            while (len > 0 && buf[len - 1] != '/') {
+                --len;
+            }
+        } else {
+            if (len == size) {
+                return false;
+            }
+            buf[len++] = '/';
+        }
+        seg = len;
+    }
+    if (len == 0) {
+        return false;
+    }
+    // no trailing slash
+    out = boost::string_ref(buf, len - 1);
+    return true;
+}
+
 std::shared_ptr<file_cache::file> server_impl::find_static_file(const std::string& dir, const std::string& path,
                                                                 const std::string& req_path) {
-    if (req_path[req_path.size() - 1] == '/') {
+    boost::string_ref rel(req_path);
+    rel.remove_prefix(path.size());
+    auto end = std::min(rel.find('?'), rel.size());
+    if (end == 0 || rel[end - 1] == '/') {
+        // no directory listings
         return nullptr;
     }
-    auto file = dir;
-    file += req_path.substr(path.size());
-    auto ret = m_file_cache.get_file(file);
+    char buf[max_static_path];
+    boost::string_ref file;
+    if (!normalize_static_path(rel, buf, sizeof(buf), file)) {
+        log_debug("invalid static file path " << req_path);
+        return nullptr;
+    }
+    auto ret = m_file_cache.get_file(dir, file);
     if (nullptr != ret) {
         return ret;
     }
-    log_debug("file " << file << " not found");
+    log_debug("file " << dir << file << " not found");
     return nullptr;
 }
 
@@ -336,9 +741,12 @@ void server_impl::register_io_services() {
         m_fiber_cache.register_io_service(iosvc);
     };
     if (!options::is_set("server.http1")) {
+        bool work_stealing = options::is_set("server.work-stealing");
         for (auto iosvc : m_http2_server->io_services()) {
             // register asio scheduler
-            iosvc->post([iosvc] { bf::use_scheduling_algorithm<fiber_sched_algorithm>(*iosvc); });
+            iosvc->post([iosvc, work_stealing] {
+                bf::use_scheduling_algorithm<fiber_sched_algorithm>(*iosvc, work_stealing);
+            });
             regf(iosvc.get());
         }
     } else {
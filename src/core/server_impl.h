@@ -58,10 +58,18 @@ class server_impl : boost::noncopyable {
     void init();
 
     /// Install a lua function as handler for a path.
-    void add_route(const std::string& path, const std::string& func);
+    ///
+    /// @param path The path, can contain parameters like /users/:id
+    /// @param func The lua function name
+    /// @param method If not empty, the route handles only requests with this method
+    void add_route(const std::string& path, const std::string& func, const std::string& method = "");
 
     /// Add a static directory route
-    void add_directory_route(const std::string& path, const std::string& dir);
+    ///
+    /// @param path The route path
+    /// @param dir The directory to serve files from
+    /// @param cache_control If not empty, the value of the cache-control header of the responses
+    void add_directory_route(const std::string& path, const std::string& dir, const std::string& cache_control = "");
 
     /// Return an io_service via round robin
     inline worker& get_worker() {
@@ -84,6 +92,9 @@ class server_impl : boost::noncopyable {
     /// Return the file cache
     inline file_cache& get_file_cache() { return m_file_cache; }
 
+    /// Return the capacity of the per session request pipeline (HTTP/1.1 only)
+    inline std::size_t pipeline_capacity() const { return m_pipeline_capacity; }
+
   private:
     /// Pointer to the server wrapper object
     server* m_server;
@@ -108,6 +119,11 @@ class server_impl : boost::noncopyable {
 
     std::size_t m_num_routes = 0;
 
+    std::size_t m_pipeline_capacity = 2;
+
+    /// Route HTTP/2 POST requests before the body has been received
+    bool m_http2_stream_body = false;
+
     metrics::meter::pointer m_metric_requests;
     metrics::meter::pointer m_metric_errors;
     metrics::meter::pointer m_metric_not_impl;
@@ -122,6 +138,9 @@ class server_impl : boost::noncopyable {
     void register_io_services();
     void unregister_io_services();
 
+    /// Send a static file, handles content codings, conditional and range requests
+    void send_static_file(request& req, std::shared_ptr<file_cache::file> file, const std::string& cache_control);
+
     std::shared_ptr<file_cache::file> find_static_file(const std::string& dir, const std::string& path,
                                                        const std::string& req_path);
 };
@@ -5,22 +5,48 @@
  * Author: Andreas Pohl
  */
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <unistd.h>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/utility/string_ref.hpp>
 #include <petrel/fiber/yield.hpp>
 
 #include "router.h"
 #include "server.h"
+#include "server_impl.h"
 #include "session.h"
 
 #include "boost/http/algorithm.hpp"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 namespace petrel {
 
 namespace bs = boost::system;
 namespace bf = boost::fibers;
 namespace bfa = bf::asio;
 
-session::session(server& srv, ba::io_service& iosvc) : m_srv(srv), m_iosvc(iosvc), m_socket(m_iosvc) {}
+constexpr std::size_t session::request::chunk_channel_capacity;
+
+#ifdef __linux__
+/// Bodies that are backed by a file and have at least this size get sent via sendfile(2). Smaller bodies are written
+/// together with the head in one call.
+constexpr std::size_t sendfile_min_size = 16 * 1024;
+#else
+constexpr std::size_t sendfile_min_size = std::numeric_limits<std::size_t>::max();
+/// The buffer size for copying files, as sendfile(2) is not available
+constexpr std::size_t file_copy_buffer_size = 64 * 1024;
+#endif
+
+session::session(server& srv, ba::io_service& iosvc)
+    : m_srv(srv), m_iosvc(iosvc), m_socket(m_iosvc), m_pipeline(srv.impl()->pipeline_capacity()) {}
 
 session::~session() {}
 
@@ -30,15 +56,30 @@ ba::io_service& session::get_io_service() { return m_iosvc; }
 
 void session::start() {
     auto self = shared_from_this();  // make sure the object stays alive until the fiber exits
+    // Responses are written by a separate fiber. This allows us to read ahead and process pipelined requests in
+    // parallel. boost.http does not support this, see socket-inl.hpp:167. Once we call async_read_request again,
+    // async_write_response fails. So we serialize responses ourselves and write them to the underlying socket.
+    bf::fiber writer(&session::write_responses, self);
     while (m_socket.is_open()) {
+        request::pointer req;
+        bool queued = false;
         try {
-            // add the req to the queue to wait for sending back a response
-            auto req = std::make_shared<request>(self);
+            req = std::make_shared<request>(self);
             req->remote_endpoint = m_socket.next_layer().remote_endpoint();
             // read the request
             m_socket.async_read_request(req->method, req->path, req->message, bfa::yield);
-            if (http::request_continue_required(req->message)) {
-                m_socket.async_write_response_continue(bfa::yield);
+            req->http11 = m_socket.write_response_native_stream();
+            req->keep_alive = keep_alive(req->message, req->http11);
+            // HTTP/1.0 clients do not know 100 (Continue), the expectation has to be ignored (RFC 7231 5.1.1)
+            req->expect_continue = req->http11 && http::request_continue_required(req->message);
+            // queue up the request to preserve the response order, this blocks if the pipeline is full
+            if (bf::channel_op_status::success != m_pipeline.push(req)) {
+                break;
+            }
+            queued = true;
+            if (req->expect_continue) {
+                // the writer sends the interim response once the responses of all earlier requests are out
+                req->wait_continue();
             }
             while (m_socket.read_state() != http::read_state::empty) {
                 switch (m_socket.read_state()) {
@@ -52,33 +93,287 @@ void session::start() {
                 }
             }
             // find a handler and execute it
-            auto& route = m_srv.get_router().find_route(req->path);
-            route(std::make_shared<::petrel::request>(req));
-            // wait for the response to become ready
-            // TODO: implement parallel pipeline request processing by queing up responses, as we need to preserve the
-            // order. boost.http does not support this, see socket-inl.hpp:167. Once we call async_read_request again,
-            // async_write_response fails.
-            req->wait();
-            send_response(req->response);
+            auto preq = std::make_shared<::petrel::request>(req);
+            auto& route = m_srv.get_router().find_route(req->path, req->method, &preq->params());
+            route(preq);
+            if (!req->keep_alive) {
+                // the client will not send anything else
+                break;
+            }
         } catch (bs::system_error& e) {
             // TODO: move into metric
             if (e.code() != ba::error::eof && e.code() != ba::error::operation_aborted &&
                 e.code() != ba::error::connection_reset) {
                 log_err(e.what());
             }
+            if (queued) {
+                // the body is incomplete, drop the request. Nothing can be sent anymore once the socket is closed,
+                // completing the response only lets the writer move past the request.
+                bs::error_code ec;
+                socket().close(ec);
+                req->send_response();
+            }
             break;
         }
     }
+    // let the writer finish the pending responses
+    m_pipeline.close();
+    writer.join();
+}
+
+void session::write_responses() {
+    request::pointer req;
+    while (bf::channel_op_status::success == m_pipeline.pop(req)) {
+        if (req->expect_continue) {
+            // all earlier responses have been written, let the client send the body now
+            static const std::string continue_line = "HTTP/1.1 100 Continue\r\n\r\n";
+            if (m_socket.is_open()) {
+                std::unique_lock<bf::mutex> lock(m_write_mtx);
+                write(ba::buffer(continue_line));
+            }
+            req->continue_sent();
+        }
+        // wait for the response to become ready
+        req->wait();
+        if (req->chunked()) {
+            send_chunked_response(*req);
+        } else if (m_socket.is_open()) {
+            send_response(*req);
+        }
+        // release the response body, even if we could not send it
+        req->set_written();
+        if (!req->keep_alive && m_socket.is_open()) {
+            bs::error_code ec;
+            socket().shutdown(bai::tcp::socket::shutdown_both, ec);
+            socket().close(ec);
+        }
+        req.reset();
+    }
+}
+
+bool session::status_has_body(std::uint_fast16_t status) { return status >= 200 && status != 204 && status != 304; }
+
+bool session::has_body(const request_type& req) { return req.method != "HEAD" && status_has_body(req.response.status); }
+
+bool session::keep_alive(const http::message& msg, bool http11) {
+    auto it = msg.headers().find("connection");
+    if (msg.headers().end() == it) {
+        return http11;
+    }
+    boost::string_ref conn(it->second);
+    if (http11) {
+        return !boost::algorithm::icontains(conn, "close");
+    }
+    return boost::algorithm::icontains(conn, "keep-alive");
+}
+
+std::string session::response_head(request_type& req, std::int64_t content_length, bool chunked) {
+    auto& res = req.response;
+    auto sc = http::status_code(res.status);
+    std::string head;
+    head.reserve(256);
+    // we answer with the version of the request, HTTP/1.0 clients may not understand 1.1 responses
+    head += req.http11 ? "HTTP/1.1 " : "HTTP/1.0 ";
+    head += std::to_string(res.status);
+    head += ' ';
+    auto reason = http::to_string<boost::string_ref>(sc);
+    head.append(reason.data(), reason.size());
+    head += "\r\n";
+    for (auto& h : res.message.headers()) {
+        if (boost::algorithm::iequals(h.first, "content-length") ||
+            boost::algorithm::iequals(h.first, "transfer-encoding")) {
+            continue;
+        }
+        head += h.first;
+        head += ": ";
+        head += h.second;
+        head += "\r\n";
+    }
+    // 1xx, 204 and 304 responses have no body, a content-length of a 304 would have to be the one of the full
+    // response. Responses to HEAD requests get the headers of the GET response.
+    if (!status_has_body(res.status)) {
+        content_length = -1;
+        chunked = false;
+    }
+    if (content_length >= 0) {
+        head += "content-length: ";
+        head += std::to_string(content_length);
+        head += "\r\n";
+    }
+    if (chunked) {
+        head += "transfer-encoding: chunked\r\n";
+    }
+    if (!req.keep_alive) {
+        head += "connection: close\r\n";
+    } else if (!req.http11) {
+        // HTTP/1.0 connections are closed after the response, unless we confirm the keep-alive
+        head += "connection: keep-alive\r\n";
+    }
+    head += "\r\n";
+    return head;
 }
 
-void session::send_response(response_type& res) {
+template <typename ConstBufferSequence>
+bool session::write(const ConstBufferSequence& bufs) {
     try {
-        auto sc = http::status_code(res.status);
-        m_socket.async_write_response(res.status, http::to_string<boost::string_ref>(sc), res.message, bfa::yield);
+        ba::async_write(socket(), bufs, bfa::yield);
+        return true;
     } catch (bs::system_error& e) {
-        log_err("failed to write response: " << e.what());
-        socket().close();
+        if (e.code() != ba::error::operation_aborted && e.code() != ba::error::connection_reset &&
+            e.code() != ba::error::broken_pipe) {
+            log_err("failed to write response: " << e.what());
+        }
+        bs::error_code ec;
+        socket().close(ec);
+    }
+    return false;
+}
+
+void session::send_response(request_type& req) {
+    auto& res = req.response;
+    std::size_t size = 0;
+    if (!res.body_parts.empty()) {
+        for (auto& p : res.body_parts) {
+            size += p.size();
+        }
+    } else if (res.body_fd >= 0) {
+        size = res.body_fd_size;
+    } else {
+        size = res.body_ref.empty() ? res.message.body().size() : res.body_ref.size();
+    }
+    auto head = response_head(req, size, false);
+    std::unique_lock<bf::mutex> lock(m_write_mtx);
+    if (!has_body(req)) {
+        // a body would be taken as the start of the next response
+        write(ba::buffer(head));
+        return;
+    }
+    if (!res.body_parts.empty()) {
+        std::vector<ba::const_buffer> bufs;
+        bufs.reserve(res.body_parts.size() + 1);
+        bufs.emplace_back(ba::buffer(head));
+        for (auto& p : res.body_parts) {
+            bufs.emplace_back(p.data(), p.size());
+        }
+        write(bufs);
+        return;
+    }
+    if (res.body_fd >= 0) {
+        if (nullptr != res.body_ref.data() && res.body_fd_size < sendfile_min_size) {
+            std::array<ba::const_buffer, 2> bufs{{ba::buffer(head), ba::buffer(res.body_ref.data(), res.body_fd_size)}};
+            write(bufs);
+        } else if (write(ba::buffer(head))) {
+            send_file(res.body_fd, res.body_fd_offset, res.body_fd_size);
+        }
+        return;
+    }
+    ba::const_buffer body = res.body_ref.empty()
+                                ? ba::const_buffer(res.message.body().data(), res.message.body().size())
+                                : ba::const_buffer(res.body_ref.data(), res.body_ref.size());
+    std::array<ba::const_buffer, 2> bufs{{ba::buffer(head), body}};
+    write(bufs);
+}
+
+bool session::send_file(int fd, std::size_t offset, std::size_t len) {
+#ifdef __linux__
+    auto& sock = socket();
+    bs::error_code ec;
+    if (!sock.native_non_blocking()) {
+        sock.native_non_blocking(true, ec);
+    }
+    auto off = static_cast<off_t>(offset);
+    while (!ec && len > 0) {
+        auto n = ::sendfile(sock.native_handle(), fd, &off, len);
+        if (n > 0) {
+            len -= n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // wait until the socket is writable again
+            sock.async_write_some(ba::null_buffers(), bfa::yield[ec]);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // a write error or the file has been truncated, the content-length is wrong anyway
+            if (n < 0 && errno != EPIPE && errno != ECONNRESET) {
+                log_err("sendfile failed: " << std::strerror(errno));
+            }
+            break;
+        }
+    }
+    if (len > 0) {
+        sock.close(ec);
+        return false;
+    }
+    return true;
+#else
+    std::vector<char> buf(std::min(len, file_copy_buffer_size));
+    while (len > 0) {
+        auto n = ::pread(fd, buf.data(), std::min(len, buf.size()), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // a read error or the file has been truncated, the content-length is wrong anyway
+            if (n < 0) {
+                log_err("reading file failed: " << std::strerror(errno));
+            }
+            break;
+        }
+        if (!write(ba::buffer(buf.data(), n))) {
+            return false;
+        }
+        offset += n;
+        len -= n;
+    }
+    if (len > 0) {
+        bs::error_code ec;
+        socket().close(ec);
+        return false;
+    }
+    return true;
+#endif
+}
+
+void session::send_chunked_response(request_type& req) {
+    // HTTP/1.0 clients do not understand chunks, we send the plain body and close the connection at the end
+    bool chunked = req.http11;
+    if (!chunked) {
+        req.keep_alive = false;
+    }
+    // the chunks get dropped if the response has no body
+    bool body = has_body(req);
+    // the chunks must not get interleaved with other writes
+    std::unique_lock<bf::mutex> lock(m_write_mtx);
+    bool ok = m_socket.is_open();
+    if (ok) {
+        auto head = response_head(req, -1, chunked);
+        ok = write(ba::buffer(head));
+    }
+    static const std::string crlf = "\r\n";
+    std::string chunk;
+    char size_buf[24];
+    while (ok && bf::channel_op_status::success == req.chunks().pop(chunk)) {
+        if (chunk.empty() || !body) {
+            // an empty chunk would end the body
+            continue;
+        }
+        if (chunked) {
+            auto len = std::snprintf(size_buf, sizeof(size_buf), "%zx\r\n", chunk.size());
+            std::array<ba::const_buffer, 3> bufs{{ba::buffer(size_buf, len), ba::buffer(chunk), ba::buffer(crlf)}};
+            ok = write(bufs);
+        } else {
+            ok = write(ba::buffer(chunk));
+        }
+    }
+    if (ok && req.chunks_aborted) {
+        // the handler failed, let the client know that the body is incomplete
+        bs::error_code ec;
+        socket().close(ec);
+    } else if (ok && chunked && body) {
+        static const std::string last_chunk = "0\r\n\r\n";
+        write(ba::buffer(last_chunk));
     }
+    // unblock the handler if we stopped early
+    req.chunks().close();
 }
 
 }  // petrel
@@ -8,15 +8,20 @@
 #ifndef SESSION_H
 #define SESSION_H
 
+#include <cstdint>
 #include <memory>
 #include <queue>
+#include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/fiber/all.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include "boost/http/buffered_socket.hpp"
 #include "boost/http/status_code.hpp"
 #include "log.h"
+#include "make_unique.h"
 
 namespace petrel {
 
@@ -44,6 +49,18 @@ class session : public std::enable_shared_from_this<session> {
         response_t& operator=(response_t&&) = default;
         std::uint_fast16_t status;
         http::message message;
+        /// If not empty, this is sent as body instead of the message body. The referenced memory is owned by the
+        /// caller and has to stay valid until the response has been written.
+        boost::string_ref body_ref;
+        /// Keeps the memory referenced by body_ref alive
+        std::shared_ptr<const void> body_owner;
+        /// If not negative, the body are body_fd_size bytes of this file starting at body_fd_offset. Large bodies
+        /// get sent via sendfile(2). Small bodies are sent from body_ref, if the file is mapped into memory.
+        int body_fd = -1;
+        std::size_t body_fd_offset = 0;
+        std::size_t body_fd_size = 0;
+        /// If not empty, the body consists of these parts. The memory is kept alive by body_owner.
+        std::vector<boost::string_ref> body_parts;
     };
 
     using response_type = response_t;
@@ -52,7 +69,10 @@ class session : public std::enable_shared_from_this<session> {
       public:
         using pointer = std::shared_ptr<request>;
 
-        explicit request(session::pointer s) : m_session(s), m_res_future(m_res_promise.get_future()) {}
+        explicit request(session::pointer s)
+            : m_session(s),
+              m_res_future(m_res_promise.get_future()),
+              m_continue_future(m_continue_promise.get_future()) {}
         request(const request&) = delete;
         request(request&&) = default;
         request& operator=(const request&) = delete;
@@ -76,19 +96,69 @@ class session : public std::enable_shared_from_this<session> {
 
         void send_response() { m_res_promise.set_value(); }
 
+        /// Send the response head now and the body in chunks. Call send_chunk for each chunk and finish_chunks at
+        /// the end.
+        void start_chunks(std::uint_fast16_t status) {
+            response.status = status;
+            m_chunks = std::make_unique<chunk_channel>(chunk_channel_capacity);
+            send_response();
+        }
+
+        /// Queue a chunk, blocks the calling fiber if too many chunks are pending. Returns false if the chunk can not
+        /// be sent anymore.
+        bool send_chunk(std::string chunk) {
+            return bf::channel_op_status::success == m_chunks->push(std::move(chunk));
+        }
+
+        /// Finish a chunked response. If abort is true, the connection gets closed without terminating the body.
+        void finish_chunks(bool abort = false) {
+            chunks_aborted = abort;
+            m_chunks->close();
+        }
+
+        /// Return true if the response body gets sent in chunks
+        bool chunked() const { return nullptr != m_chunks; }
+
+        /// Return the chunk channel
+        bf::buffered_channel<std::string>& chunks() { return *m_chunks; }
+
         void wait() { m_res_future.get(); }
 
+        /// Return a future that becomes ready once the response has been written or dropped. Can be called once.
+        bf::future<void> written_future() { return m_written_promise.get_future(); }
+
+        /// Mark the response as written
+        void set_written() { m_written_promise.set_value(); }
+
+        /// Wait until the writer has sent the 100 (Continue) response
+        void wait_continue() { m_continue_future.get(); }
+
+        /// Mark the 100 (Continue) response as sent
+        void continue_sent() { m_continue_promise.set_value(); }
+
         std::string method;
         std::string path;
         std::string proto = "http";
         http::message message;
         bai::tcp::endpoint remote_endpoint;
         response_type response;
+        bool keep_alive = true;
+        bool http11 = true;
+        bool chunks_aborted = false;
+        /// The client waits for a 100 (Continue) response before sending the body
+        bool expect_continue = false;
 
       private:
+        using chunk_channel = bf::buffered_channel<std::string>;
+        static constexpr std::size_t chunk_channel_capacity = 8;
+
         session::pointer m_session;
         bf::promise<void> m_res_promise;
         bf::future<void> m_res_future;
+        bf::promise<void> m_written_promise;
+        bf::promise<void> m_continue_promise;
+        bf::future<void> m_continue_future;
+        std::unique_ptr<chunk_channel> m_chunks;
     };
 
     using request_type = request;
@@ -112,12 +182,53 @@ class session : public std::enable_shared_from_this<session> {
     void start();
 
     /// Send a response
-    void send_response(response_type& res);
+    void send_response(request_type& req);
+
+    /// Send a response with a body that gets passed in chunks (see request::start_chunks)
+    void send_chunked_response(request_type& req);
 
   private:
     server& m_srv;
     ba::io_service& m_iosvc;
     http::buffered_socket m_socket;
+
+    /// Requests that have been read and dispatched but not answered yet. The writer fiber pops them in the order
+    /// they came in, so responses go out in request order even if the handlers finish out of order.
+    bf::buffered_channel<request::pointer> m_pipeline;
+
+    /// Serializes writes of the writer fiber and the chunked responses
+    bf::mutex m_write_mtx;
+
+    /// Write the responses for all requests in the pipeline.
+    void write_responses();
+
+    /// Return false for status codes that must not have a body (1xx, 204 and 304).
+    static bool status_has_body(std::uint_fast16_t status);
+
+    /// Return false if no body must be sent with the response to a request, e.g. the response to a HEAD request.
+    static bool has_body(const request_type& req);
+
+    /// Return true if the connection should be kept open after responding to a request.
+    static bool keep_alive(const http::message& msg, bool http11);
+
+    /// Serialize the status line and headers of a response.
+    ///
+    /// @param req The request
+    /// @param content_length The content-length header value, no header is added if negative
+    /// @param chunked Add a chunked transfer-encoding header
+    static std::string response_head(request_type& req, std::int64_t content_length, bool chunked);
+
+    /// Send a part of a file to the socket via sendfile(2) or via a buffer, if sendfile(2) is not available. The
+    /// caller has to hold m_write_mtx. Closes the socket on errors.
+    ///
+    /// @return false if the file could not be sent completely
+    bool send_file(int fd, std::size_t offset, std::size_t len);
+
+    /// Write buffers to the socket. The caller has to hold m_write_mtx. Closes the socket on errors.
+    ///
+    /// @return false if the write failed
+    template <typename ConstBufferSequence>
+    bool write(const ConstBufferSequence& bufs);
 };
 
 }  // petrel
@@ -24,26 +24,44 @@ worker::~worker() {
     join();
 }
 
+#ifdef SO_REUSEPORT
+using reuse_port_option = ba::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 void worker::do_accept(tcp::acceptor& acceptor, server& srv) {
     while (acceptor.is_open()) {
         bs::error_code ec;
-        // get an io service to use for a new client, we pick them via round robin
-        auto& worker = srv.impl()->get_worker();
+        // get an io service to use for a new client, we pick them via round robin unless the kernel is balancing the
+        // connections for us (SO_REUSEPORT)
+        auto& worker = m_reuse_port ? *this : srv.impl()->get_worker();
         auto& iosvc = worker.io_service();
         auto new_session = std::make_shared<session>(srv, iosvc);
         acceptor.async_accept(new_session->socket(), bfa::yield[ec]);
         if (!ec) {
-            worker.add_session(new_session);
-            worker.m_new_session_cv.notify_one();
+            if (&worker == this) {
+                // no need to hand over the session to another thread
+                bf::fiber(&session::start, new_session).detach();
+            } else {
+                worker.add_session(new_session);
+                worker.m_new_session_cv.notify_one();
+            }
         }
     }
 }
 
-void worker::add_endpoint(tcp::endpoint& ep, bs::error_code& ec) {
+void worker::add_endpoint(tcp::endpoint& ep, bs::error_code& ec, bool reuse_port) {
     try {
         auto acceptor = tcp::acceptor(m_iosvc);
         acceptor.open(ep.protocol());
         acceptor.set_option(tcp::acceptor::reuse_address(true));
+        if (reuse_port) {
+#ifdef SO_REUSEPORT
+            acceptor.set_option(reuse_port_option(true));
+            m_reuse_port = true;
+#else
+            throw bs::system_error(ba::error::operation_not_supported);
+#endif
+        }
         acceptor.bind(ep);
         int backlog = options::opts["server.backlog"].as<int>();
         if (backlog == 0) {
@@ -63,7 +81,7 @@ void worker::add_session(session::pointer new_session) {
 
 void worker::run(server& srv) {
     for (auto& acceptor : m_acceptors) {
-        bf::fiber(worker::do_accept, std::ref(acceptor), std::ref(srv)).detach();
+        bf::fiber(&worker::do_accept, this, std::ref(acceptor), std::ref(srv)).detach();
     }
     bf::fiber([this] {
         while (!m_stop) {
@@ -76,7 +94,7 @@ void worker::run(server& srv) {
         }
     }).detach();
     // Run the io service
-    bf::use_scheduling_algorithm<fiber_sched_algorithm>(m_iosvc);
+    bf::use_scheduling_algorithm<fiber_sched_algorithm>(m_iosvc, options::is_set("server.work-stealing"));
     m_iosvc.run();
 }
 
@@ -40,7 +40,13 @@ class worker : boost::noncopyable {
     ~worker();
 
     /// Create an acceptor for a tcp endpoint.
-    void add_endpoint(ba::ip::tcp::endpoint& ep, bs::error_code& ec);
+    ///
+    /// @param ep The endpoint to listen on
+    /// @param ec Set on error
+    /// @param reuse_port If true, the socket gets bound with SO_REUSEPORT. Every worker can listen on the same
+    /// endpoint then and the kernel balances new connections across the workers. Accepted sessions stay on the
+    /// accepting worker.
+    void add_endpoint(ba::ip::tcp::endpoint& ep, bs::error_code& ec, bool reuse_port = false);
 
     /// Add a session to this worker
     void add_session(session::pointer new_session);
@@ -71,8 +77,9 @@ class worker : boost::noncopyable {
     bf::condition_variable m_new_session_cv;
 
     std::vector<ba::ip::tcp::acceptor> m_acceptors;
+    bool m_reuse_port = false;
 
-    static void do_accept(ba::ip::tcp::acceptor& acceptor, server& srv);
+    void do_accept(ba::ip::tcp::acceptor& acceptor, server& srv);
 };
 
 }  // petrel
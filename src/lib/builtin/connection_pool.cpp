@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+#include "connection_pool.h"
+#include "options.h"
+
+#include <cerrno>
+#include <sys/socket.h>
+
+namespace petrel {
+namespace lib {
+
+namespace bs = boost::system;
+
+ba::io_service::id connection_pool::id;
+
+connection_pool::connection_pool(ba::io_service& iosvc)
+    : ba::io_service::service(iosvc),
+      m_idle_timeout(std::chrono::seconds(options::get_int("client.keepalive-timeout", 30))),
+      m_max_idle(options::get_int("client.keepalive-max-idle", 16)),
+      m_next_sweep(clock::now() + m_idle_timeout) {}
+
+bool connection_pool::acquire(const std::string& key, socket_type& sock) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_pool.find(key);
+    if (m_pool.end() == it) {
+        return false;
+    }
+    auto& conns = it->second;
+    auto now = clock::now();
+    while (!conns.empty()) {
+        auto& conn = conns.back();
+        if (conn.since + m_idle_timeout > now && healthy(conn.sock)) {
+            sock = std::move(conn.sock);
+            conns.pop_back();
+            return true;
+        }
+        log_debug("dropping idle connection to " << key);
+        conns.pop_back();
+    }
+    return false;
+}
+
+void connection_pool::release(const std::string& key, socket_type& sock) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto now = clock::now();
+    if (now >= m_next_sweep) {
+        sweep(now);
+    }
+    auto& conns = m_pool[key];
+    if (conns.size() >= m_max_idle) {
+        bs::error_code ec;
+        sock.close(ec);
+        return;
+    }
+    conns.emplace_back(std::move(sock), now);
+}
+
+std::size_t connection_pool::idle(const std::string& key) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_pool.find(key);
+    return m_pool.end() != it ? it->second.size() : 0;
+}
+
+void connection_pool::shutdown_service() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_pool.clear();
+}
+
+void connection_pool::sweep(clock::time_point now) {
+    for (auto it = m_pool.begin(); it != m_pool.end();) {
+        auto& conns = it->second;
+        while (!conns.empty() && conns.front().since + m_idle_timeout <= now) {
+            conns.pop_front();
+        }
+        if (conns.empty()) {
+            it = m_pool.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_next_sweep = now + m_idle_timeout;
+}
+
+bool connection_pool::healthy(socket_type& sock) {
+    if (!sock.is_open()) {
+        return false;
+    }
+    char c;
+    auto n = ::recv(sock.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    // nothing to read is what we expect, 0 means the peer closed the connection
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+}  // lib
+}  // petrel
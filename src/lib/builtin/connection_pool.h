@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+#ifndef LIB_CONNECTION_POOL_H
+#define LIB_CONNECTION_POOL_H
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <boost/asio.hpp>
+
+#include "log.h"
+
+namespace petrel {
+namespace lib {
+
+namespace ba = boost::asio;
+
+/// connection_pool class
+/// Keeps idle keep-alive connections per io_service, so library objects that live for one request only can reuse
+/// upstream connections. Get the pool of an io_service via ba::use_service<connection_pool>(iosvc).
+class connection_pool : public ba::io_service::service {
+    set_log_tag("connection_pool");
+
+  public:
+    using socket_type = ba::ip::tcp::socket;
+    using clock = std::chrono::steady_clock;
+
+    static ba::io_service::id id;
+
+    explicit connection_pool(ba::io_service& iosvc);
+
+    /// Take an idle connection. Connections that have been idle for too long or that have been closed by the peer
+    /// are dropped.
+    ///
+    /// @param key The host:port key
+    /// @param sock Receives the connection
+    /// @return false if there is no usable connection
+    bool acquire(const std::string& key, socket_type& sock);
+
+    /// Put a connection back into the pool. The connection gets closed if the pool is full.
+    ///
+    /// @param key The host:port key
+    /// @param sock The connection, no data must be pending
+    void release(const std::string& key, socket_type& sock);
+
+    /// Return the number of idle connections for a key
+    std::size_t idle(const std::string& key);
+
+  private:
+    struct idle_connection {
+        idle_connection(socket_type&& s, clock::time_point t) : sock(std::move(s)), since(t) {}
+        socket_type sock;
+        clock::time_point since;
+    };
+
+    /// The idle connections per key, the most recently used ones are at the back
+    std::unordered_map<std::string, std::deque<idle_connection>> m_pool;
+    /// Fibers of an io_service can be moved to other threads if work stealing is enabled
+    std::mutex m_mtx;
+    clock::duration m_idle_timeout;
+    std::size_t m_max_idle;
+    clock::time_point m_next_sweep;
+
+    void shutdown_service() override;
+
+    /// Drop the expired connections of all keys, the caller has to hold m_mtx
+    void sweep(clock::time_point now);
+
+    /// Return true if the peer did not close the connection and did not send unexpected data
+    static bool healthy(socket_type& sock);
+};
+
+}  // lib
+}  // petrel
+
+#endif  // LIB_CONNECTION_POOL_H
@@ -6,11 +6,16 @@
  */
 
 #include "http2_client.h"
-#include "make_unique.h"
+#include "resolver_cache.h"
+#include "server.h"
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <stdexcept>
 #include <boost/asio.hpp>
 #include <boost/fiber/all.hpp>
-#include <sstream>
+#include <petrel/fiber/yield.hpp>
 
 namespace petrel {
 namespace lib {
@@ -19,11 +24,15 @@ DECLARE_LIB_BEGIN(http2_client);
 ADD_LIB_METHOD(connect);
 ADD_LIB_METHOD(disconnect);
 ADD_LIB_METHOD(get);
+ADD_LIB_METHOD(post);
+ADD_LIB_METHOD(put);
+ADD_LIB_METHOD(request);
+ADD_LIB_METHOD(submit);
+ADD_LIB_METHOD(wait);
 ADD_LIB_METHOD(read_timeout);
 DECLARE_LIB_BUILTIN_END();
 
-namespace bs = boost::system;
-namespace bf = boost::fibers;
+namespace bfa = bf::asio;
 
 int http2_client::connect(lua_State* L) {
     m_host = luaL_checkstring(L, 1);
@@ -38,9 +47,18 @@ int http2_client::connect(lua_State* L) {
     if (lua_isboolean(L, 4)) {
         m_ssl_verify = lua_toboolean(L, 4);
     }
+    // IPv6 addresses have to be enclosed in brackets
+    m_authority = m_host.find(':') == std::string::npos ? m_host : "[" + m_host + "]";
+    m_authority += ":";
+    m_authority += m_port;
+    m_key = m_authority;
+    if (m_ssl) {
+        m_key += m_ssl_verify ? "/tls" : "/tls-noverify";
+    }
 
+    m_tls.reset();
     if (m_ssl) {
-        m_tls = std::make_unique<ba::ssl::context>(ba::ssl::context::sslv23);
+        m_tls = std::make_shared<ba::ssl::context>(ba::ssl::context::sslv23);
         m_tls->set_default_verify_paths();
         if (m_ssl_verify) {
             m_tls->set_verify_mode(ba::ssl::verify_peer);
@@ -50,84 +68,208 @@ int http2_client::connect(lua_State* L) {
         if (ec) {
             luaL_error(L, "configure_tls_context failed: %s", ec.message().c_str());
         }
+        if (m_ssl_verify) {
+            // the certificate has to be issued for the host, not just by a trusted CA
+            m_tls->set_verify_callback(ba::ssl::rfc2818_verification(m_host));
+        }
     }
 
-    bf::promise<bs::error_code> promise;
-    bf::future<bs::error_code> future(promise.get_future());
-
-    // TODO: use resolver_cache (extend the nghttp2 client interface, so we can pass in an endpoint iterator)
-    if (m_ssl) {
-        m_session = std::make_unique<http2::client::session>(io_service(), *m_tls, m_host, m_port);
-    } else {
-        m_session = std::make_unique<http2::client::session>(io_service(), m_host, m_port);
-    }
-    m_session->read_timeout(m_read_timeout);
-    m_session->on_connect([&promise](ba::ip::tcp::resolver::iterator) { promise.set_value(bs::error_code()); });
-    m_session->on_error([&promise](const bs::error_code& ec) { promise.set_value(ec); });
-
-    auto ec = future.get();
-    if (ec) {
-        luaL_error(L, "connect failed: %s", ec.message().c_str());
+    // connect now if there is no session yet, so connection errors show up here
+    auto session = ba::use_service<http2_session_pool>(io_service()).acquire(m_key);
+    if (nullptr == session) {
+        try {
+            session = open_session();
+        } catch (std::exception& e) {
+            luaL_error(L, "%s", e.what());
+        }
     }
-
-    // remove error handler
-    m_session->on_error([](const bs::error_code&) {});
-
+    session->release();
     m_connected = true;
     return 0;
 }
 
 int http2_client::disconnect(lua_State*) {
-    close();
+    // the session stays in the pool, responses that have not been awaited get dropped
+    m_calls.clear();
+    m_connected = false;
     return 0;
 }
 
-int http2_client::get(lua_State* L) {
-    auto* path = luaL_checkstring(L, 1);
+http2_session::pointer http2_client::open_session() {
+    auto session = std::make_shared<http2_session>(io_service(), m_tls);
+    bs::error_code ec;
+    if (m_ssl) {
+        // the session needs the host name for SNI, so nghttp2 has to resolve it
+        ec = session->connect(m_host, m_port, m_read_timeout);
+    } else {
+        // resolve via the cache and pass the addresses to nghttp2, which can not take resolved endpoints
+        using iterator = resolver_cache::tcp_cache::resolver_iterator;
+        try {
+            auto& resolver = context().server().get_resolver_cache();
+            auto iter = resolver.async_resolve<resolver_cache::tcp>(io_service(), m_host, m_port, bfa::yield);
+            ec = ba::error::host_not_found;
+            // try the addresses in order, like async_connect does
+            for (; ec && iter != iterator(); ++iter) {
+                ec = session->connect(iter->endpoint().address().to_string(), m_port, m_read_timeout);
+            }
+        } catch (bs::system_error& e) {
+            ec = e.code();
+        }
+    }
+    if (ec) {
+        throw std::runtime_error("connect failed: " + ec.message());
+    }
+    // take a stream slot before other fibers can get the session
+    session->reserve();
+    ba::use_service<http2_session_pool>(io_service()).add(m_key, session);
+    return session;
+}
 
+void http2_client::start(call& c) {
     if (!m_connected) {
-        luaL_error(L, "not connected");
+        throw std::runtime_error("not connected");
     }
+    std::string uri = m_ssl ? "https://" : "http://";
+    uri += m_authority;
+    uri += c.path;
+    auto& pool = ba::use_service<http2_session_pool>(io_service());
+    for (int attempt = 0;; ++attempt) {
+        auto session = pool.acquire(m_key);
+        if (nullptr == session) {
+            // all sessions are busy or closed
+            session = open_session();
+        }
+        try {
+            c.stream = session->start_request(c.method, uri, c.data, c.headers);
+            c.session = session;
+            return;
+        } catch (std::runtime_error&) {
+            // the session may have been closed since we got it, try another one
+            if (attempt > 0 || session->alive()) {
+                throw;
+            }
+        }
+    }
+}
 
-    bf::promise<bs::error_code> promise;
-    bf::future<bs::error_code> future(promise.get_future());
-    m_session->on_error([&promise](const bs::error_code& ec) { promise.set_value(ec); });
+void http2_client::finish(call& c) {
+    wait_response(c);
+    auto& s = *c.stream;
+    // a refused stream has not been processed, requests with safe methods can be sent again anyway
+    bool safe = c.method == "GET" || c.method == "HEAD";
+    if (!s.error.empty() && !c.retried && (s.refused || (safe && s.status == 0))) {
+        c.retried = true;
+        start(c);
+        wait_response(c);
+    }
+    if (!c.stream->error.empty()) {
+        throw std::runtime_error(c.stream->error);
+    }
+}
 
-    std::string url = "http://";
-    url += m_host;
-    url += ":";
-    url += m_port;
-    url += path;
+void http2_client::wait_response(call& c) {
+    // the read timeout of the session only fires if the whole connection is idle, so every stream has its own
+    auto timeout = std::chrono::milliseconds(m_read_timeout.total_milliseconds());
+    if (bf::future_status::timeout == c.stream->future.wait_for(timeout)) {
+        c.session->cancel(c.stream);
+        throw std::runtime_error("stream timed out");
+    }
+}
 
-    bs::error_code ec;
-    std::ostringstream content_strm;
-    int status;
-    auto req = m_session->submit(ec, "GET", url);
-    req->on_response([&promise, &content_strm, &status](const http2::client::response& res) {
-        status = res.status_code();
-        res.on_data([&promise, &content_strm](const uint8_t* data, std::size_t len) {
-            if (len == 0) {
-                promise.set_value(bs::error_code());
-            } else {
-                content_strm.write(reinterpret_cast<const char*>(data), len);
+std::int32_t http2_client::start_request(lua_State* L, const char* method, bool has_body) {
+    int arg = 1;
+    std::string m = nullptr != method ? method : luaL_checkstring(L, arg++);
+    std::string path = luaL_checkstring(L, arg++);
+    std::string data;
+    if (has_body) {
+        if (lua_isstring(L, arg)) {
+            std::size_t len;
+            const char* p = lua_tolstring(L, arg, &len);
+            data.assign(p, len);
+        }
+        ++arg;
+    }
+    http2::header_map headers;
+    if (lua_istable(L, arg)) {
+        lua_pushnil(L);
+        while (lua_next(L, arg)) {
+            // numeric keys must not be converted, it would confuse lua_next
+            if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+                std::size_t len;
+                const char* p = lua_tolstring(L, -2, &len);
+                // HTTP/2 header names are lowercase
+                std::string name(p, len);
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                p = lua_tolstring(L, -1, &len);
+                headers.emplace(std::move(name), http2::header_value{std::string(p, len), false});
             }
-        });
-    });
+            lua_pop(L, 1);
+        }
+    }
+    call c;
+    c.method = std::move(m);
+    c.path = std::move(path);
+    c.data = std::move(data);
+    c.headers = std::move(headers);
+    try {
+        start(c);
+    } catch (std::exception& e) {
+        luaL_error(L, "submit failed: %s", e.what());
+    }
+    auto id = m_next_id++;
+    m_calls.emplace(id, std::move(c));
+    return id;
+}
 
-    ec = future.get();
-    if (ec) {
-        luaL_error(L, "get failed: %s", ec.message().c_str());
+int http2_client::push_response(lua_State* L, std::int32_t id) {
+    auto it = m_calls.find(id);
+    if (it == m_calls.end()) {
+        luaL_error(L, "unknown stream %d", id);
+    }
+    auto c = std::move(it->second);
+    m_calls.erase(it);
+    try {
+        finish(c);
+    } catch (std::exception& e) {
+        luaL_error(L, "request failed: %s", e.what());
     }
+    auto& s = *c.stream;
+    lua_pushinteger(L, s.status);
+    lua_pushlstring(L, s.content.data(), s.content.size());
+    lua_createtable(L, 0, s.headers.size());
+    for (auto& h : s.headers) {
+        lua_pushlstring(L, h.first.data(), h.first.size());
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushlstring(L, h.second.value.data(), h.second.value.size());
+        } else {
+            // combine repeated headers into a list
+            lua_pushliteral(L, ", ");
+            lua_pushlstring(L, h.second.value.data(), h.second.value.size());
+            lua_concat(L, 3);
+        }
+        lua_rawset(L, -3);
+    }
+    return 3;  // status code, data and headers makes 3 results
+}
+
+int http2_client::get(lua_State* L) { return push_response(L, start_request(L, "GET", false)); }
 
-    // remove error handler
-    m_session->on_error([](const bs::error_code&) {});
+int http2_client::post(lua_State* L) { return push_response(L, start_request(L, "POST", true)); }
 
-    lua_pushinteger(L, status);
-    lua_pushstring(L, content_strm.str().c_str());
+int http2_client::put(lua_State* L) { return push_response(L, start_request(L, "PUT", true)); }
 
-    return 2;
+int http2_client::request(lua_State* L) { return push_response(L, start_request(L, nullptr, true)); }
+
+int http2_client::submit(lua_State* L) {
+    lua_pushinteger(L, start_request(L, nullptr, true));
+    return 1;
 }
 
+int http2_client::wait(lua_State* L) { return push_response(L, luaL_checkinteger(L, 1)); }
+
 int http2_client::read_timeout(lua_State* L) {
     int t = luaL_checkinteger(L, 1);
     m_read_timeout = bp::millisec(t);
@@ -8,9 +8,13 @@
 #ifndef LIB_HTTP2_CLIENT_H
 #define LIB_HTTP2_CLIENT_H
 
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <nghttp2/asio_http2_client.h>
 
+#include "http2_session_pool.h"
 #include "library_builtin.h"
 
 namespace petrel {
@@ -21,6 +25,9 @@ namespace bp = boost::posix_time;
 namespace http2 = nghttp2::asio_http2;
 
 /// http2_client class
+/// Requests get multiplexed on the shared sessions of the http2_session_pool of the io_service: submit sends a request
+/// and returns a stream id without waiting for the response, wait returns the response of a stream. get, post, put and
+/// request combine both. Sessions are shared by all clients with the same host, port and TLS settings.
 class http2_client : public library {
   public:
     explicit http2_client(lib_context* ctx) : library(ctx), m_read_timeout(0, 0, 5, 0) {}
@@ -28,25 +35,67 @@ class http2_client : public library {
     int connect(lua_State* L);
     int disconnect(lua_State* L);
     int get(lua_State* L);
+    int post(lua_State* L);
+    int put(lua_State* L);
+    int request(lua_State* L);
+    int submit(lua_State* L);
+    int wait(lua_State* L);
     int read_timeout(lua_State* L);
 
+    /// A request and its stream
+    struct call {
+        std::string method;
+        std::string path;
+        std::string data;
+        http2::header_map headers;
+        std::shared_ptr<http2_session::stream> stream;
+        /// The session of the stream
+        http2_session::pointer session;
+        bool retried = false;
+    };
+
+    /// Submit a request on a pooled session, a new session gets connected if needed. Throws std::runtime_error on
+    /// errors. Can be called from several fibers.
+    void start(call& c);
+
+    /// Wait for the response of a call. Requests that have not been processed by the server get sent once more on
+    /// another session. Throws std::runtime_error if the request failed or timed out.
+    void finish(call& c);
+
   private:
-    std::unique_ptr<http2::client::session> m_session;
     std::string m_host;
     std::string m_port;
+    std::string m_authority;
+    /// The key of the sessions in the pool
+    std::string m_key;
     bool m_ssl = false;
     bool m_ssl_verify = true;
-    std::unique_ptr<ba::ssl::context> m_tls;
+    std::shared_ptr<ba::ssl::context> m_tls;
     bp::time_duration m_read_timeout;
     bool m_connected = false;
 
-    inline void close() {
-        if (m_connected) {
-            m_session->shutdown();
-            m_session.reset(nullptr);
-            m_connected = false;
-        }
-    }
+    /// Calls that have been submitted from lua but not awaited yet, by id
+    std::unordered_map<std::int32_t, call> m_calls;
+    std::int32_t m_next_id = 1;
+
+    /// Connect a new session with a reserved stream slot and add it to the pool, throws std::runtime_error on errors
+    http2_session::pointer open_session();
+
+    /// Wait for the stream of a call for up to the read timeout, the stream gets reset on a timeout and
+    /// std::runtime_error is thrown
+    void wait_response(call& c);
+
+    /// Read the method, path, body and headers from the lua stack and submit a request, the call gets added to
+    /// m_calls
+    ///
+    /// @param L The lua state
+    /// @param method The method or nullptr, if the method is the first parameter
+    /// @param has_body The request takes a body parameter after the path
+    /// @return The call id
+    std::int32_t start_request(lua_State* L, const char* method, bool has_body);
+
+    /// Wait for a call of m_calls and push its status, content and headers
+    int push_response(lua_State* L, std::int32_t id);
 };
 
 }  // lib
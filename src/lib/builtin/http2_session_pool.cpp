@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+#include "http2_session_pool.h"
+#include "make_unique.h"
+#include "options.h"
+
+#include <stdexcept>
+#include <nghttp2/nghttp2.h>
+
+namespace petrel {
+namespace lib {
+
+http2_session::http2_session(ba::io_service& iosvc, std::shared_ptr<ba::ssl::context> tls)
+    : m_iosvc(iosvc), m_tls(std::move(tls)), m_idle_since(clock::now().time_since_epoch().count()) {}
+
+bs::error_code http2_session::connect(const std::string& host, const std::string& port,
+                                      const bp::time_duration& read_timeout) {
+    // the handlers run on the io_service and may outlive this call, so they share the promise
+    auto promise = std::make_shared<bf::promise<bs::error_code>>();
+    bf::future<bs::error_code> future(promise->get_future());
+    auto connecting = std::make_shared<bool>(true);
+
+    std::unique_ptr<http2::client::session> session;
+    if (m_tls) {
+        session = std::make_unique<http2::client::session>(m_iosvc, *m_tls, host, port);
+    } else {
+        session = std::make_unique<http2::client::session>(m_iosvc, host, port);
+    }
+    session->read_timeout(read_timeout);
+    m_broken = false;
+    std::weak_ptr<http2_session> self = shared_from_this();
+    auto* sess = session.get();
+    session->on_connect([promise, connecting, self, sess](ba::ip::tcp::resolver::iterator) {
+        *connecting = false;
+        // replace the handler before waking up the fiber, so errors of the connection can not reach the promise
+        sess->on_error([self](const bs::error_code& ec) {
+            // fail the pending streams, if the connection breaks
+            if (auto s = self.lock()) {
+                s->m_broken = true;
+                s->fail_all(ec.message());
+            }
+        });
+        promise->set_value(bs::error_code());
+    });
+    session->on_error([promise, connecting](const bs::error_code& ec) {
+        if (*connecting) {
+            *connecting = false;
+            promise->set_value(ec);
+        }
+    });
+
+    auto ec = future.get();
+    if (!ec) {
+        m_session = std::move(session);
+    }
+    return ec;
+}
+
+std::shared_ptr<http2_session::stream> http2_session::start_request(const std::string& method,
+                                                                    const std::string& uri, const std::string& data,
+                                                                    const http2::header_map& headers) {
+    auto s = std::make_shared<stream>();
+    std::weak_ptr<http2_session> self = shared_from_this();
+    bf::promise<bs::error_code> promise;
+    bf::future<bs::error_code> future(promise.get_future());
+    // the session must only be used on its io_service, dispatch runs the handler right away if we are on it
+    m_iosvc.dispatch([&] {
+        if (m_broken || !m_session) {
+            promise.set_value(ba::error::not_connected);
+            return;
+        }
+        bs::error_code ec;
+        auto* req = data.empty() ? m_session->submit(ec, method, uri, headers)
+                                 : m_session->submit(ec, method, uri, data, headers);
+        if (ec) {
+            // the session takes no new streams, because it received GOAWAY or the connection has been closed
+            m_broken = true;
+        } else {
+            s->id = m_next_id++;
+            s->request = req;
+            m_pending.emplace(s->id, s);
+            req->on_response([s](const http2::client::response& res) {
+                s->status = res.status_code();
+                s->headers = res.header();
+                if (res.content_length() > 0) {
+                    s->content.reserve(res.content_length());
+                }
+                res.on_data([s](const uint8_t* data, std::size_t len) {
+                    s->content.append(reinterpret_cast<const char*>(data), len);
+                });
+            });
+            req->on_close([s, self](uint32_t error_code) {
+                auto session = self.lock();
+                if (!session) {
+                    return;
+                }
+                if (error_code == NGHTTP2_REFUSED_STREAM) {
+                    // the server did not process the stream, it can be sent again. This says nothing about the
+                    // connection, after a GOAWAY frame the next submit fails and marks the session broken.
+                    session->finish(*s, "stream refused", true);
+                } else if (error_code != NGHTTP2_NO_ERROR) {
+                    session->finish(*s, std::string("stream reset: ") + nghttp2_http2_strerror(error_code));
+                } else {
+                    session->finish(*s);
+                }
+            });
+        }
+        promise.set_value(ec);
+    });
+    auto ec = future.get();
+    if (ec) {
+        stream_done();
+        throw std::runtime_error(ec.message());
+    }
+    return s;
+}
+
+void http2_session::cancel(std::shared_ptr<stream> s) {
+    auto self = shared_from_this();
+    m_iosvc.dispatch([self, s] {
+        if (!s->done && nullptr != s->request) {
+            // on_close finishes the stream
+            s->request->cancel(NGHTTP2_CANCEL);
+        }
+    });
+}
+
+void http2_session::shutdown() {
+    m_broken = true;
+    auto self = shared_from_this();
+    m_iosvc.dispatch([self] {
+        // GOAWAY lets the server finish the open streams, on_close or on_error complete them
+        if (self->m_session) {
+            self->m_session->shutdown();
+        }
+    });
+}
+
+void http2_session::finish(stream& s, std::string error, bool refused) {
+    if (s.done) {
+        return;
+    }
+    s.done = true;
+    s.request = nullptr;
+    s.error = std::move(error);
+    s.refused = refused;
+    m_pending.erase(s.id);
+    stream_done();
+    s.promise.set_value();
+}
+
+void http2_session::fail_all(const std::string& error) {
+    auto streams = std::move(m_pending);
+    m_pending.clear();
+    for (auto& s : streams) {
+        finish(*s.second, error);
+    }
+}
+
+void http2_session::stream_done() {
+    if (--m_active == 0) {
+        m_idle_since = clock::now().time_since_epoch().count();
+    }
+}
+
+ba::io_service::id http2_session_pool::id;
+
+http2_session_pool::http2_session_pool(ba::io_service& iosvc)
+    : ba::io_service::service(iosvc),
+      m_idle_timeout(std::chrono::seconds(options::get_int("client.keepalive-timeout", 30))),
+      m_max_streams(options::get_int("client.http2-max-streams", 100)),
+      m_next_sweep(clock::now() + m_idle_timeout) {}
+
+http2_session::pointer http2_session_pool::acquire(const std::string& key) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto now = clock::now();
+    if (now >= m_next_sweep) {
+        sweep(now);
+    }
+    auto it = m_sessions.find(key);
+    if (m_sessions.end() == it) {
+        return nullptr;
+    }
+    auto& sessions = it->second;
+    http2_session::pointer ret;
+    for (auto s = sessions.begin(); s != sessions.end();) {
+        if (expired(**s, now)) {
+            log_debug("dropping session to " << key);
+            (*s)->shutdown();
+            s = sessions.erase(s);
+            continue;
+        }
+        // the first session with a free stream slot, so the others can become idle and expire
+        if (nullptr == ret && (*s)->active_streams() < m_max_streams) {
+            // take the slot while holding the lock, so concurrent fibers do not exceed the limit
+            ret = *s;
+            ret->reserve();
+        }
+        ++s;
+    }
+    if (sessions.empty()) {
+        m_sessions.erase(it);
+    }
+    return ret;
+}
+
+void http2_session_pool::add(const std::string& key, http2_session::pointer session) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sessions[key].push_back(std::move(session));
+}
+
+std::size_t http2_session_pool::sessions(const std::string& key) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_sessions.find(key);
+    return m_sessions.end() != it ? it->second.size() : 0;
+}
+
+void http2_session_pool::shutdown_service() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sessions.clear();
+}
+
+void http2_session_pool::sweep(clock::time_point now) {
+    for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+        auto& sessions = it->second;
+        for (auto s = sessions.begin(); s != sessions.end();) {
+            if (expired(**s, now)) {
+                (*s)->shutdown();
+                s = sessions.erase(s);
+            } else {
+                ++s;
+            }
+        }
+        if (sessions.empty()) {
+            it = m_sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_next_sweep = now + m_idle_timeout;
+}
+
+bool http2_session_pool::expired(const http2_session& session, clock::time_point now) const {
+    return !session.alive() || (session.active_streams() == 0 && session.idle_since() + m_idle_timeout <= now);
+}
+
+}  // lib
+}  // petrel
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+#ifndef LIB_HTTP2_SESSION_POOL_H
+#define LIB_HTTP2_SESSION_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/fiber/all.hpp>
+#include <nghttp2/asio_http2_client.h>
+
+#include "log.h"
+
+namespace petrel {
+namespace lib {
+
+namespace ba = boost::asio;
+namespace bp = boost::posix_time;
+namespace bs = boost::system;
+namespace bf = boost::fibers;
+namespace http2 = nghttp2::asio_http2;
+
+/// http2_session class
+/// A HTTP/2 client session that can be shared by several library objects. Streams can be started from any fiber,
+/// the nghttp2 session is only used on its io_service.
+class http2_session : public std::enable_shared_from_this<http2_session> {
+  public:
+    using pointer = std::shared_ptr<http2_session>;
+    using clock = std::chrono::steady_clock;
+
+    /// A submitted request, the members get set on the io_service of the session
+    struct stream {
+        stream() : future(promise.get_future()) {}
+        std::int32_t id = 0;
+        int status = 0;
+        std::string content;
+        http2::header_map headers;
+        /// Not empty if the request failed
+        std::string error;
+        /// The server refused the stream without processing it, e.g. after sending GOAWAY
+        bool refused = false;
+        bool done = false;
+        /// The nghttp2 request, only valid until the stream is done
+        const http2::client::request* request = nullptr;
+        bf::promise<void> promise;
+        /// Becomes ready once the response is complete or the request failed
+        bf::future<void> future;
+    };
+
+    /// Ctor.
+    ///
+    /// @param iosvc The io_service of the session
+    /// @param tls The TLS context or nullptr for cleartext sessions
+    http2_session(ba::io_service& iosvc, std::shared_ptr<ba::ssl::context> tls);
+
+    /// Connect to a host, blocks the calling fiber
+    ///
+    /// @param host The host name or address
+    /// @param port The port
+    /// @param read_timeout The read timeout of the connection
+    bs::error_code connect(const std::string& host, const std::string& port, const bp::time_duration& read_timeout);
+
+    /// Submit a request, throws std::runtime_error on errors. The session is broken afterwards if it can not take new
+    /// streams. The response is complete once the future is ready.
+    /// The request uses a stream slot reserved before (see reserve), the slot is released when the stream is done
+    /// or the submit failed.
+    ///
+    /// @param method The request method
+    /// @param uri The request URI
+    /// @param data The request body
+    /// @param headers The request headers
+    std::shared_ptr<stream> start_request(const std::string& method, const std::string& uri, const std::string& data,
+                                          const http2::header_map& headers);
+
+    /// Reset a stream, the stream fails if it has not been completed yet
+    void cancel(std::shared_ptr<stream> s);
+
+    /// Shut the session down gracefully, no new streams can be started but pending streams can still complete
+    void shutdown();
+
+    /// Reserve a stream slot for start_request
+    void reserve() { ++m_active; }
+
+    /// Give back a reserved stream slot that has not been used
+    void release() { stream_done(); }
+
+    /// Return false once the connection has been closed, failed or refuses new streams
+    bool alive() const { return !m_broken; }
+
+    /// Return the number of streams that have been started and not finished yet
+    std::size_t active_streams() const { return m_active; }
+
+    /// Return the time when the last stream has finished
+    clock::time_point idle_since() const { return clock::time_point(clock::duration(m_idle_since.load())); }
+
+  private:
+    ba::io_service& m_iosvc;
+    std::shared_ptr<ba::ssl::context> m_tls;
+    std::unique_ptr<http2::client::session> m_session;
+
+    /// The pending streams, only used on the io_service
+    std::unordered_map<std::int32_t, std::shared_ptr<stream>> m_pending;
+    std::int32_t m_next_id = 1;
+
+    std::atomic_bool m_broken{false};
+    std::atomic<std::size_t> m_active{0};
+    std::atomic<clock::rep> m_idle_since;
+
+    /// Complete a stream, must be called on the io_service
+    void finish(stream& s, std::string error = std::string(), bool refused = false);
+
+    /// Fail all pending streams, must be called on the io_service
+    void fail_all(const std::string& error);
+
+    /// Count a finished stream
+    void stream_done();
+};
+
+/// http2_session_pool class
+/// Keeps HTTP/2 client sessions per io_service, so requests of many library objects get multiplexed onto a few
+/// connections. Get the pool of an io_service via ba::use_service<http2_session_pool>(iosvc).
+class http2_session_pool : public ba::io_service::service {
+    set_log_tag("http2_session_pool");
+
+  public:
+    using clock = http2_session::clock;
+
+    static ba::io_service::id id;
+
+    explicit http2_session_pool(ba::io_service& iosvc);
+
+    /// Return a session with a free stream slot and reserve the slot. Sessions that have been closed or that have
+    /// been idle for too long are dropped.
+    ///
+    /// @param key The key of the session, it has to contain everything that makes sessions different
+    /// @return nullptr if there is no usable session, the slot has to be used or released otherwise
+    http2_session::pointer acquire(const std::string& key);
+
+    /// Add a new session
+    void add(const std::string& key, http2_session::pointer session);
+
+    /// Return the number of sessions for a key
+    std::size_t sessions(const std::string& key);
+
+  private:
+    std::unordered_map<std::string, std::vector<http2_session::pointer>> m_sessions;
+    /// Fibers of an io_service can be moved to other threads if work stealing is enabled
+    std::mutex m_mtx;
+    clock::duration m_idle_timeout;
+    std::size_t m_max_streams;
+    clock::time_point m_next_sweep;
+
+    void shutdown_service() override;
+
+    /// Drop the closed and expired sessions of all keys, the caller has to hold m_mtx
+    void sweep(clock::time_point now);
+
+    /// Return true if a session should be dropped
+    bool expired(const http2_session& session, clock::time_point now) const;
+};
+
+}  // lib
+}  // petrel
+
+#endif  // LIB_HTTP2_SESSION_POOL_H
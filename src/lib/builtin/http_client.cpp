@@ -6,13 +6,19 @@
  */
 
 #include "http_client.h"
+#include "connection_pool.h"
 #include "log.h"
+#include "make_unique.h"
 #include "resolver_cache.h"
 #include "server.h"
 
 #include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -33,36 +39,88 @@ ADD_LIB_METHOD(post);
 ADD_LIB_METHOD(read_timeout);
 ADD_LIB_METHOD(connect_timeout);
 ADD_LIB_METHOD(disable_keepalive);
+ADD_LIB_FUNCTION(multi_get);
 DECLARE_LIB_BUILTIN_END();
 
 namespace bf = boost::fibers;
 namespace bfa = bf::asio;
 namespace balg = boost::algorithm;
 
+/// The number of bytes to receive at once
+constexpr std::size_t receive_size = 16 * 1024;
+
+/// The maximum size of a response head or a chunk size line
+constexpr std::size_t max_head_size = 64 * 1024;
+
+/// std::isdigit is undefined for negative values of char
+inline bool is_digit(char c) { return std::isdigit(static_cast<unsigned char>(c)); }
+
 void http_client::timeout_handler(const bs::error_code& ec) {
     if (ba::error::operation_aborted != ec) {
         m_sock.cancel();
     }
 }
 
-int http_client::connect(lua_State* L) {
-    m_host = luaL_checkstring(L, 1);
-    if (lua_isstring(L, 2)) {
-        m_port = lua_tostring(L, 2);
+void http_client::start_timer(ba::deadline_timer& timer, const bp::time_duration& timeout) {
+    if (m_deadline.is_not_a_date_time()) {
+        timer.expires_from_now(timeout);
     } else {
-        m_port = "80";
+        timer.expires_at(m_deadline);
+    }
+    timer.async_wait(boost::bind(&http_client::timeout_handler, this, ba::placeholders::error));
+}
+
+http_client::~http_client() { release(); }
+
+void http_client::release() {
+    if (m_connected && m_reusable) {
+        ba::use_service<connection_pool>(io_service()).release(m_pool_key, m_sock);
+        m_connected = false;
+        m_reusable = false;
+    } else {
+        close();
+    }
+}
+
+void http_client::open() {
+    auto& resolver = context().server().get_resolver_cache();
+    auto deadline = resolver_cache::clock::time_point::max();
+    if (!m_deadline.is_not_a_date_time()) {
+        // the resolver cache uses the steady clock
+        auto left = m_deadline - ba::deadline_timer::traits_type::now();
+        deadline = resolver_cache::clock::now() + std::chrono::microseconds(left.total_microseconds());
+    }
+    auto ep_iter = resolver.async_resolve<resolver_cache::tcp>(io_service(), m_host, m_port, bfa::yield, deadline);
+    ba::deadline_timer timer(io_service());
+    start_timer(timer, m_connect_timeout);
+    ba::async_connect(m_sock, ep_iter, bfa::yield);
+    timer.cancel();
+    m_connected = true;
+    m_reused = false;
+}
+
+void http_client::connect_to(const std::string& host, const std::string& port) {
+    release();
+    m_host = host;
+    m_port = port;
+    m_pool_key = m_host + ":" + m_port;
+    if (m_keep_alive && ba::use_service<connection_pool>(io_service()).acquire(m_pool_key, m_sock)) {
+        m_connected = true;
+        m_reused = true;
+        return;
     }
-    using boost::asio::ip::tcp;
     // DNS lookup and connect
+    open();
+}
+
+int http_client::connect(lua_State* L) {
+    std::string host = luaL_checkstring(L, 1);
+    std::string port = "80";
+    if (lua_isstring(L, 2)) {
+        port = lua_tostring(L, 2);
+    }
     try {
-        auto& resolver = context().server().get_resolver_cache();
-        auto ep_iter = resolver.async_resolve<resolver_cache::tcp>(io_service(), m_host, m_port, bfa::yield);
-        ba::deadline_timer timer(io_service());
-        timer.expires_from_now(m_connect_timeout);
-        timer.async_wait(boost::bind(&http_client::timeout_handler, this, ba::placeholders::error));
-        ba::async_connect(m_sock, ep_iter, bfa::yield);
-        timer.cancel();
-        m_connected = true;
+        connect_to(host, port);
     } catch (bs::system_error& e) {
         luaL_error(L, "connect failed: %s", e.what());
     }
@@ -70,31 +128,45 @@ int http_client::connect(lua_State* L) {
 }
 
 int http_client::disconnect(lua_State*) {
-    close();
+    // keep the connection for the next client
+    release();
     return 0;  // no results
 }
 
-int http_client::get(lua_State* L) {
-    boost::string_ref path(luaL_checkstring(L, 1));
-    if (!m_connected) {
-        luaL_error(L, "not connected");
-    }
-    // Create request
+void http_client::write_request(const char* method, boost::string_ref path, const char* data, std::size_t len) {
     std::ostream request_strm(&m_req_buf);
-    request_strm << "GET " << path << " HTTP/1.1\r\n";
+    request_strm << method << " " << path << " HTTP/1.1\r\n";
     request_strm << "Host: " << m_host << "\r\n";
     request_strm << "Accept: */*\r\n";
     request_strm << "User-Agent: petrel/http_client\r\n";
     if (!m_keep_alive) {
-        request_strm << "Connection: keep-alive\r\n";
+        request_strm << "Connection: close\r\n";
+    }
+    if (nullptr != data) {
+        request_strm << "Content-Length: " << len << "\r\n\r\n";
+        request_strm.write(data, len);
+    } else {
+        request_strm << "\r\n";
     }
-    request_strm << "\r\n";
-    return send_recv(L);
+}
+
+int http_client::get(lua_State* L) {
+    boost::string_ref path(luaL_checkstring(L, 1));
+    if (!m_connected) {
+        luaL_error(L, "not connected");
+    }
+    write_request("GET", path, nullptr, 0);
+    try {
+        exchange(true);
+    } catch (std::exception& e) {
+        luaL_error(L, "%s", e.what());
+    }
+    return push_response(L);
 }
 
 int http_client::post(lua_State* L) {
     boost::string_ref path(luaL_checkstring(L, 1));
-    const char* data = nullptr;
+    const char* data = "";
     std::size_t len = 0;
     if (lua_isstring(L, 2)) {
         data = lua_tolstring(L, 2, &len);
@@ -102,94 +174,360 @@ int http_client::post(lua_State* L) {
     if (!m_connected) {
         luaL_error(L, "not connected");
     }
-    // Create request
-    std::ostream request_strm(&m_req_buf);
-    request_strm << "POST " << path << " HTTP/1.1\r\n";
-    request_strm << "Host: " << m_host << "\r\n";
-    request_strm << "Accept: */*\r\n";
-    request_strm << "User-Agent: petrel/http_client\r\n";
-    if (!m_keep_alive) {
-        request_strm << "Connection: keep-alive\r\n";
+    write_request("POST", path, data, len);
+    try {
+        exchange(false);
+    } catch (std::exception& e) {
+        luaL_error(L, "%s", e.what());
     }
-    request_strm << "Content-Length: " << len << "\r\n\r\n";
-    if (len > 0 && nullptr != data) {
-        request_strm.write(data, len);
+    return push_response(L);
+}
+
+int http_client::multi_get(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int default_timeout = luaL_optinteger(L, 2, 0);
+    // the timeout covers the whole request, from the DNS lookup to the end of the response
+    auto start = ba::deadline_timer::traits_type::now();
+    struct call {
+        std::unique_ptr<http_client> client;
+        std::string host;
+        std::string port;
+        std::string path;
+        std::string error;
+    };
+    auto& ctx = context(L);
+    std::vector<call> calls(lua_objlen(L, 1));
+    for (std::size_t i = 0; i < calls.size(); ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "multi_get: request %d is no table", static_cast<int>(i + 1));
+        }
+        auto& c = calls[i];
+        lua_getfield(L, -1, "host");
+        if (!lua_isstring(L, -1)) {
+            luaL_error(L, "multi_get: request %d has no host", static_cast<int>(i + 1));
+        }
+        c.host = lua_tostring(L, -1);
+        lua_getfield(L, -2, "port");
+        c.port = lua_isstring(L, -1) ? lua_tostring(L, -1) : "80";
+        lua_getfield(L, -3, "path");
+        c.path = lua_isstring(L, -1) ? lua_tostring(L, -1) : "/";
+        lua_getfield(L, -4, "timeout");
+        int timeout = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : default_timeout;
+        lua_pop(L, 5);
+        c.client = std::make_unique<http_client>(&ctx);
+        if (timeout > 0) {
+            c.client->m_deadline = start + bp::millisec(timeout);
+        }
+    }
+    // the requests run on sibling fibers of the current thread, lua is not touched until all of them are done
+    std::vector<bf::fiber> fibers;
+    fibers.reserve(calls.size());
+    for (auto& c : calls) {
+        auto* pc = &c;
+        fibers.emplace_back([pc] {
+            try {
+                pc->client->connect_to(pc->host, pc->port);
+                pc->client->write_request("GET", pc->path, nullptr, 0);
+                pc->client->exchange(true);
+            } catch (std::exception& e) {
+                pc->error = e.what();
+            }
+        });
     }
-    return send_recv(L);
+    for (auto& f : fibers) {
+        f.join();
+    }
+    lua_createtable(L, calls.size(), 0);
+    for (std::size_t i = 0; i < calls.size(); ++i) {
+        auto& c = calls[i];
+        lua_createtable(L, 0, 2);
+        if (c.error.empty()) {
+            c.client->push_response(L);
+            lua_setfield(L, -4, "headers");
+            lua_setfield(L, -3, "content");
+            lua_setfield(L, -2, "status");
+        } else {
+            lua_pushstring(L, c.error.c_str());
+            lua_setfield(L, -2, "error");
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+boost::string_ref http_client::buffered() const {
+    // a streambuf keeps its input sequence in one piece
+    auto data = m_res_buf.data();
+    return boost::string_ref(ba::buffer_cast<const char*>(data), ba::buffer_size(data));
+}
+
+void http_client::receive(ba::deadline_timer& timer, bs::error_code& ec) {
+    start_timer(timer, m_read_timeout);
+    auto n = m_sock.async_read_some(m_res_buf.prepare(receive_size), bfa::yield[ec]);
+    timer.cancel();
+    m_res_buf.commit(n);
+}
+
+void http_client::receive(ba::deadline_timer& timer) {
+    bs::error_code ec;
+    receive(timer, ec);
+    if (ec == ba::error::eof) {
+        throw std::runtime_error("read failed: incomplete response");
+    } else if (ec) {
+        throw std::runtime_error("read failed: " + ec.message());
+    }
+}
+
+std::size_t http_client::receive_line(ba::deadline_timer& timer) {
+    std::size_t scanned = 0;
+    for (;;) {
+        auto data = buffered();
+        auto pos = data.substr(scanned).find("\r\n");
+        if (boost::string_ref::npos != pos) {
+            return scanned + pos;
+        }
+        if (data.size() > max_head_size) {
+            throw std::runtime_error("invalid response: line too long");
+        }
+        scanned = data.size() > 0 ? data.size() - 1 : 0;
+        receive(timer);
+    }
+}
+
+void http_client::send_request(ba::deadline_timer& timer, bs::error_code& ec) {
+    // the request stays in the buffer until we know if we have to send it again
+    start_timer(timer, m_read_timeout);
+    ba::async_write(m_sock, m_req_buf.data(), bfa::yield[ec]);
+    timer.cancel();
+    receive_head(timer, ec);
 }
 
-int http_client::send_recv(lua_State* L) {
+void http_client::receive_head(ba::deadline_timer& timer, bs::error_code& ec) {
+    // receive until the buffer contains the complete response head
+    std::size_t scanned = 0;
+    while (!ec) {
+        auto data = buffered();
+        auto pos = data.substr(scanned).find("\r\n\r\n");
+        if (boost::string_ref::npos != pos) {
+            m_head.assign(data.data(), scanned + pos + 4);
+            m_res_buf.consume(m_head.size());
+            return;
+        }
+        if (data.size() > max_head_size) {
+            ec = ba::error::message_size;
+            return;
+        }
+        scanned = data.size() > 3 ? data.size() - 3 : 0;
+        receive(timer, ec);
+    }
+}
+
+void http_client::parse_head() {
+    // the status line, e.g. HTTP/1.1 200 OK
+    boost::string_ref head(m_head);
+    auto eol = head.find("\r\n");
+    auto line = head.substr(0, eol);
+    if (line.size() < 12 || !line.starts_with("HTTP/1.") || line[8] != ' ' || !is_digit(line[9]) ||
+        !is_digit(line[10]) || !is_digit(line[11])) {
+        throw std::runtime_error("invalid response");
+    }
+    m_status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    if (m_status < 100) {
+        throw std::runtime_error("invalid response: invalid status " + std::to_string(m_status));
+    }
+    // HTTP/1.0 servers close the connection by default
+    m_res_keep_alive = m_keep_alive && line[7] == '1';
+    m_headers.clear();
+    m_location.clear();
+    m_content_len = 0;
+    m_has_content_len = false;
+    m_chunked = false;
+    // the header lines, the names get lowercased in place
+    auto pos = eol + 2;
+    while (pos < m_head.size() - 2) {
+        eol = m_head.find("\r\n", pos);
+        auto colon = m_head.find(':', pos);
+        if (colon >= eol || colon == pos) {
+            throw std::runtime_error("invalid response: invalid header line");
+        }
+        std::transform(&m_head[pos], &m_head[colon], &m_head[pos],
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        boost::string_ref name(&m_head[pos], colon - pos);
+        auto value = boost::string_ref(&m_head[colon + 1], eol - colon - 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        m_headers.emplace_back(name, value);
+        if (name == "content-length") {
+            char* end = nullptr;
+            m_content_len = std::strtoull(value.data(), &end, 10);
+            if (value.empty() || !is_digit(value.front()) || end != value.data() + value.size()) {
+                throw std::runtime_error("invalid response: invalid content-length");
+            }
+            m_has_content_len = true;
+        } else if (name == "transfer-encoding") {
+            // any other coding than chunked as last one means the body ends when the connection gets closed
+            m_chunked = balg::iends_with(value, "chunked");
+        } else if (name == "connection" && balg::icontains(value, "close")) {
+            m_res_keep_alive = false;
+        } else if (name == "location") {
+            m_location = value;
+        }
+        pos = eol + 2;
+    }
+}
+
+void http_client::receive_chunked(ba::deadline_timer& timer) {
+    m_body.clear();
+    for (;;) {
+        // the chunk size line, chunk extensions are ignored
+        auto len = receive_line(timer);
+        auto data = buffered();
+        std::size_t size = 0;
+        std::size_t digits = 0;
+        for (; digits < len && std::isxdigit(static_cast<unsigned char>(data[digits])); ++digits) {
+            if (size > (std::numeric_limits<std::size_t>::max() >> 4)) {
+                throw std::runtime_error("invalid response: invalid chunk size");
+            }
+            auto c = std::tolower(static_cast<unsigned char>(data[digits]));
+            size = (size << 4) | (c <= '9' ? c - '0' : c - 'a' + 10);
+        }
+        if (digits == 0) {
+            throw std::runtime_error("invalid response: invalid chunk size");
+        }
+        m_res_buf.consume(len + 2);
+        if (size == 0) {
+            break;
+        }
+        while (m_res_buf.size() < size + 2) {
+            receive(timer);
+        }
+        data = buffered();
+        if (data[size] != '\r' || data[size + 1] != '\n') {
+            throw std::runtime_error("invalid response: invalid chunk");
+        }
+        m_body.append(data.data(), size);
+        m_res_buf.consume(size + 2);
+    }
+    // skip the trailers up to the empty line
+    std::size_t len;
+    do {
+        len = receive_line(timer);
+        m_res_buf.consume(len + 2);
+    } while (len > 0);
+}
+
+void http_client::exchange(bool idempotent) {
+    m_reusable = false;
+    // anything left from a previous response would break the parser
+    m_res_buf.consume(m_res_buf.size());
     try {
-        // send query
-        ba::async_write(m_sock, m_req_buf, bfa::yield);
         ba::deadline_timer timer(io_service());
-        timer.expires_from_now(m_read_timeout);
-        timer.async_wait(boost::bind(&http_client::timeout_handler, this, ba::placeholders::error));
         bs::error_code ec;
-        ba::async_read_until(m_sock, m_res_buf, "\r\n\r\n", bfa::yield[ec]);
-        timer.cancel();
-        if (ec && ec != ba::error::eof) {
-            luaL_error(L, "read failed: %s", ec.message().c_str());
-        }
-        std::istream response_strm(&m_res_buf);
-        std::string line;
-        // read status line
-        std::getline(response_strm, line);
-        if (!response_strm || line.find("HTTP/") != 0) {
-            luaL_error(L, "invalid response");
-        }
-        auto pos = line.find(' ', 5);
-        if (std::string::npos == pos) {
-            luaL_error(L, "invalid response: no status");
-        }
-        int status = std::atoi(line.c_str() + pos + 1);
-        if (status < 100 || status > 999) {
-            luaL_error(L, "invalid response: invalid status %d");
-        }
-        // read headers
-        std::string location;
-        std::size_t content_len = 0;
-        while (std::getline(response_strm, line) && line != "\r") {
-            if (balg::istarts_with(line, "location: ")) {
-                location = line.substr(10);
-            } else if (balg::istarts_with(line, "content-length: ")) {
-                content_len = std::atoi(line.c_str() + 16);
+        send_request(timer, ec);
+        if (ec && ec != ba::error::operation_aborted && m_reused && idempotent && m_res_buf.size() == 0) {
+            // the server closed the idle connection before it got our request, retry on a new connection
+            close();
+            open();
+            ec.clear();
+            send_request(timer, ec);
+        }
+        m_req_buf.consume(m_req_buf.size());
+        for (;;) {
+            if (ec == ba::error::eof) {
+                throw std::runtime_error("read failed: incomplete response");
+            } else if (ec) {
+                throw std::runtime_error("read failed: " + ec.message());
             }
+            parse_head();
+            if (m_status >= 200) {
+                break;
+            }
+            // an interim response like 100 Continue or 103 Early Hints, the final response follows
+            if (m_status == 101) {
+                throw std::runtime_error("invalid response: unexpected protocol switch");
+            }
+            receive_head(timer, ec);
+        }
+        if (m_status == 302 && m_location.empty()) {
+            throw std::runtime_error("invalid 302 redirect: no location header");
         }
-        // check for redirect
-        if (status == 302) {
-            if (location.empty()) {
-                luaL_error(L, "invalid 302 redirect: no location header");
+        if (m_status == 204 || m_status == 304) {
+            m_content_len = 0;
+        } else if (m_chunked) {
+            receive_chunked(timer);
+            m_content_len = m_body.size();
+        } else if (m_has_content_len) {
+            // receive the rest of the body, if the buffer does not contain it yet
+            while (m_res_buf.size() < m_content_len) {
+                receive(timer);
             }
-            lua_pushinteger(L, status);
-            lua_pushstring(L, location.c_str());
         } else {
-            lua_pushinteger(L, status);
-            if (content_len > 0) {
-                auto to_read = content_len - m_res_buf.size();
-                if (to_read > 0) {
-                    // if the buffer does not contain the full content yet, receive the rest
-                    timer.expires_from_now(m_read_timeout);
-                    timer.async_wait(boost::bind(&http_client::timeout_handler, this, ba::placeholders::error));
-                    ba::async_read(m_sock, m_res_buf, boost::asio::transfer_at_least(to_read), bfa::yield[ec]);
-                    timer.cancel();
-                    if (ec && ec != ba::error::eof) {
-                        luaL_error(L, "read failed: %s", ec.message().c_str());
-                    }
-                }
-                luaL_Buffer lbuf;
-                luaL_buffinit(L, &lbuf);
-                std::for_each(ba::buffers_begin(m_res_buf.data()), ba::buffers_end(m_res_buf.data()),
-                              [&lbuf](const char c) { luaL_addchar(&lbuf, c); });
-                luaL_pushresult(&lbuf);
-            } else {
-                lua_pushstring(L, "");
+            // the body ends when the connection gets closed
+            m_res_keep_alive = false;
+            ec.clear();
+            while (!ec) {
+                receive(timer, ec);
             }
+            if (ec != ba::error::eof) {
+                throw std::runtime_error("read failed: " + ec.message());
+            }
+            m_content_len = m_res_buf.size();
         }
-    } catch (bs::system_error& e) {
-        luaL_error(L, e.what());
+    } catch (std::exception&) {
+        close();
+        m_req_buf.consume(m_req_buf.size());
+        m_res_buf.consume(m_res_buf.size());
+        throw;
+    }
+}
+
+int http_client::push_response(lua_State* L) {
+    lua_pushinteger(L, m_status);
+    if (m_status == 302) {
+        // redirect
+        lua_pushlstring(L, m_location.data(), m_location.size());
+    } else if (m_chunked) {
+        lua_pushlstring(L, m_body.data(), m_body.size());
+    } else {
+        lua_pushlstring(L, buffered().data(), m_content_len);
+    }
+    lua_createtable(L, 0, m_headers.size());
+    for (auto& h : m_headers) {
+        lua_pushlstring(L, h.first.data(), h.first.size());
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushlstring(L, h.second.data(), h.second.size());
+        } else {
+            // combine repeated headers into a list
+            lua_pushliteral(L, ", ");
+            lua_pushlstring(L, h.second.data(), h.second.size());
+            lua_concat(L, 3);
+        }
+        lua_rawset(L, -3);
+    }
+    finish_response();
+    return 3;  // status code, data and headers makes 3 results
+}
+
+void http_client::finish_response() {
+    if (m_chunked) {
+        m_body.clear();
+    } else {
+        m_res_buf.consume(m_content_len);
+    }
+    m_content_len = 0;
+    // the connection can be reused if nothing but the response has been received
+    m_reusable = m_res_keep_alive && m_res_buf.size() == 0;
+    if (!m_reusable) {
+        m_res_buf.consume(m_res_buf.size());
     }
-    return 2;  // status code and data makes 2 results
 }
 
 int http_client::read_timeout(lua_State* L) {
@@ -8,7 +8,12 @@
 #ifndef LIB_HTTP_CLIENT_H
 #define LIB_HTTP_CLIENT_H
 
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <boost/asio.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include "library_builtin.h"
 
@@ -19,11 +24,17 @@ namespace ba = boost::asio;
 namespace bp = boost::posix_time;
 namespace bs = boost::system;
 
+/// http_client class
+/// Connections are taken from and returned to the connection pool of the io_service, so keep-alive connections
+/// survive the request the client object has been created for.
 class http_client : public library {
   public:
     explicit http_client(lib_context* ctx)
         : library(ctx), m_sock(m_iosvc), m_read_timeout(0, 0, 5, 0), m_connect_timeout(0, 0, 5, 0) {}
 
+    /// Dtor. Returns the connection to the pool if it can be reused.
+    ~http_client();
+
     int connect(lua_State* L);
     int disconnect(lua_State* L);
     int get(lua_State* L);
@@ -32,27 +43,107 @@ class http_client : public library {
     int connect_timeout(lua_State* L);
     int disable_keepalive(lua_State* L);
 
+    /// Send GET requests to several hosts concurrently. Takes an array of tables with the fields host, port
+    /// (default 80), path (default /) and timeout (in milliseconds for the whole request including the DNS lookup
+    /// and connect) and an optional default timeout as second parameter. Returns an array with a table per request
+    /// holding status and content or error.
+    static int multi_get(lua_State* L);
+
   private:
     ba::ip::tcp::socket m_sock;
     ba::streambuf m_req_buf;
     ba::streambuf m_res_buf;
     std::string m_host;
     std::string m_port;
+    std::string m_pool_key;
     bp::time_duration m_read_timeout;
     bp::time_duration m_connect_timeout;
+    /// If set, all operations have to be done by this time and the timeouts above do not apply
+    bp::ptime m_deadline;
     bool m_keep_alive = true;
     bool m_connected = false;
+    /// The connection has been taken from the pool
+    bool m_reused = false;
+    /// The last response has been read completely and the connection can be reused
+    bool m_reusable = false;
+
+    /// The last response. The header names and values and the location reference m_head. The body of chunked
+    /// responses gets decoded into m_body, other bodies are at the front of m_res_buf.
+    int m_status = 0;
+    std::string m_head;
+    std::vector<std::pair<boost::string_ref, boost::string_ref>> m_headers;
+    boost::string_ref m_location;
+    std::string m_body;
+    std::size_t m_content_len = 0;
+    bool m_has_content_len = false;
+    bool m_chunked = false;
+    bool m_res_keep_alive = false;
+
+    /// Take a connection from the pool or connect, throws bs::system_error on errors
+    void connect_to(const std::string& host, const std::string& port);
+
+    /// Write a request into m_req_buf
+    ///
+    /// @param method The request method
+    /// @param path The request path
+    /// @param data The request body or nullptr if the request has no body
+    /// @param len The length of the body
+    void write_request(const char* method, boost::string_ref path, const char* data, std::size_t len);
+
+    /// Send the request and receive the response. The body is at the front of m_res_buf afterwards, it has to be
+    /// released via finish_response. Throws std::runtime_error on errors.
+    ///
+    /// @param idempotent The request can be sent again, if a reused connection turns out to be closed
+    void exchange(bool idempotent);
+
+    /// Push the status, the content (or location of redirects) and the headers of the last response and release the
+    /// body
+    int push_response(lua_State* L);
+
+    /// Drop the body of the last response and check if the connection can be reused
+    void finish_response();
 
-    int send_recv(lua_State* L);
+    /// Send the request and move the response head from m_res_buf into m_head
+    void send_request(ba::deadline_timer& timer, bs::error_code& ec);
+
+    /// Receive until m_res_buf contains a response head and move it into m_head
+    void receive_head(ba::deadline_timer& timer, bs::error_code& ec);
+
+    /// Parse the status line and the headers in m_head
+    void parse_head();
+
+    /// Receive and decode a chunked body into m_body
+    void receive_chunked(ba::deadline_timer& timer);
+
+    /// Receive more data into m_res_buf, the throwing version fails on eof too
+    void receive(ba::deadline_timer& timer, bs::error_code& ec);
+    void receive(ba::deadline_timer& timer);
+
+    /// Receive until m_res_buf contains a line and return its length without the CRLF
+    std::size_t receive_line(ba::deadline_timer& timer);
+
+    /// Return the received data
+    boost::string_ref buffered() const;
+
+    /// Resolve the host and connect, throws bs::system_error on errors
+    void open();
 
     void timeout_handler(const bs::error_code& ec);
 
+    /// Start the timer of an operation, it expires after the timeout or at the deadline if one is set
+    void start_timer(ba::deadline_timer& timer, const bp::time_duration& timeout);
+
     inline void close() {
         if (m_connected) {
-            m_sock.close();
+            bs::error_code ec;
+            m_sock.close(ec);
             m_connected = false;
         }
+        m_reusable = false;
     }
+
+    /// Return the connection to the pool if it can be reused, close it otherwise
+    void release();
 };
 
 }  // lib
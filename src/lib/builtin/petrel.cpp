@@ -12,6 +12,7 @@
 #include "server_impl.h"
 
 #include <algorithm>
+#include <boost/algorithm/string/case_conv.hpp>
 #include <boost/fiber/all.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/utility/string_ref.hpp>
@@ -63,7 +64,11 @@ void petrel::load() {
 int petrel::add_route(lua_State* L) {
     std::string path = luaL_checkstring(L, 1);
     std::string func = luaL_checkstring(L, 2);
-    context(L).server().impl()->add_route(path, func);
+    std::string method;
+    if (lua_isstring(L, 3)) {
+        method = boost::algorithm::to_upper_copy(std::string(lua_tostring(L, 3)));
+    }
+    context(L).server().impl()->add_route(path, func, method);
     return 0;  // no results
 }
 
@@ -76,7 +81,16 @@ int petrel::add_directory_route(lua_State* L) {
     if (dir[dir.size() - 1] != '/') {
         dir += '/';
     }
-    context(L).server().impl()->add_directory_route(path, dir);
+    // optional settings
+    std::string cache_control;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "cache_control");
+        if (lua_isstring(L, -1)) {
+            cache_control = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    context(L).server().impl()->add_directory_route(path, dir, cache_control);
     return 0;  // no results
 }
 
@@ -19,10 +19,13 @@ class petrel : public library {
     static void load();
 
     /// Add a route. This function takes two parameters: (1) a path and (2) a lua function name. The function will be
-    /// called for each request with the given path.
+    /// called for each request with the given path. The path can contain parameters like /users/:id, the captured
+    /// values are passed to the handler in request.params. An optional third parameter restricts the route to a
+    /// request method.
     static int add_route(lua_State* L);
 
-    /// Add a static dir route.
+    /// Add a static dir route. This function takes two parameters: (1) a path and (2) a directory. An optional table
+    /// as third parameter can hold settings for the route: cache_control sets the cache-control header.
     static int add_directory_route(lua_State* L);
 
     /// Return the library search path list
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+// Compares the fiber_sched_algorithm, that blocks in io_service::run_one() if no fiber is ready, with the algorithm
+// it replaced, that polled the io_service via a keepalive timer with an interval of 100ns to 30ms.
+//
+// - idle CPU: the CPU time a worker thread uses while there is nothing to do
+// - CPU with requests: the CPU time of the worker while handlers get posted with quiet periods in between
+// - wakeup latency: the time from posting a handler to the io_service of a worker, like an I/O completion does, until
+//   the fiber that waits for the handler runs, after the worker has been quiet for a while
+//
+// Usage: bench_fiber_sched [idle seconds] [wakeups]
+
+#include "fiber_sched_algorithm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/fiber/all.hpp>
+
+namespace legacy {
+
+namespace bf = boost::fibers;
+
+auto constexpr WAIT_INTERVAL_SHORT = std::chrono::nanoseconds(100);
+auto constexpr WAIT_INTERVAL_LONG = std::chrono::milliseconds(1);
+auto constexpr WAIT_INTERVAL_EXTRALONG = std::chrono::milliseconds(30);
+
+/// The polling scheduling algorithm: the io_service runs in the main context, a keepalive timer yields to the fibers
+/// in an interval that depends on the request rate
+class fiber_sched_algorithm : public bf::algo::algorithm {
+  private:
+    boost::asio::io_service& m_iosvc;
+    boost::asio::steady_timer m_suspend_timer;
+    boost::asio::steady_timer m_keepalive_timer;
+    bf::scheduler::ready_queue_t m_ready_queue{};
+
+    thread_local static std::uint_fast64_t m_counter;
+    thread_local static double m_rate_l;
+    thread_local static double m_rate_xl;
+    thread_local static std::chrono::nanoseconds m_expires;
+
+  public:
+    explicit fiber_sched_algorithm(boost::asio::io_service& iosvc)
+        : m_iosvc(iosvc), m_suspend_timer(iosvc), m_keepalive_timer(iosvc) {
+        on_empty_io_service();
+    }
+
+    void awakened(bf::context* ctx) noexcept { ctx->ready_link(m_ready_queue); }
+
+    bf::context* pick_next() noexcept {
+        bf::context* ctx(nullptr);
+        if (!m_ready_queue.empty()) {
+            ctx = &m_ready_queue.front();
+            m_ready_queue.pop_front();
+        }
+        return ctx;
+    }
+
+    bool has_ready_fibers() const noexcept { return !m_ready_queue.empty(); }
+
+    void suspend_until(std::chrono::steady_clock::time_point const& suspend_time) noexcept {
+        if (m_suspend_timer.expires_at() != suspend_time) {
+            m_suspend_timer.expires_at(suspend_time);
+            m_suspend_timer.async_wait([](boost::system::error_code const&) {});
+        }
+    }
+
+    void notify() noexcept { m_suspend_timer.expires_at(std::chrono::steady_clock::now()); }
+
+    void on_empty_io_service() {
+        m_iosvc.post([]() { boost::this_fiber::yield(); });
+
+        m_rate_l = m_rate_l * 0.99999 - 0.0001 + m_counter;
+        m_rate_xl = m_rate_xl * 0.99999 - 0.00009 + m_counter;
+        m_counter = 0;
+
+        if (m_rate_l < 0.0) {
+            m_rate_l = 0.0;
+        }
+        if (m_rate_xl < 0.0) {
+            m_rate_xl = 0.0;
+        }
+
+        if (m_rate_xl == 0.0) {
+            m_expires = WAIT_INTERVAL_EXTRALONG;
+        } else if (m_rate_l == 0.0) {
+            m_expires = WAIT_INTERVAL_LONG;
+        } else {
+            m_expires = WAIT_INTERVAL_SHORT;
+        }
+
+        m_keepalive_timer.expires_from_now(m_expires);
+        m_keepalive_timer.async_wait(std::bind(&fiber_sched_algorithm::on_empty_io_service, this));
+    }
+
+    /// Called for every request
+    static void update() {
+        m_counter++;
+        m_expires = WAIT_INTERVAL_SHORT;
+    }
+};
+
+thread_local std::uint_fast64_t fiber_sched_algorithm::m_counter = 0;
+thread_local double fiber_sched_algorithm::m_rate_l = 1.0;
+thread_local double fiber_sched_algorithm::m_rate_xl = 1.0;
+thread_local std::chrono::nanoseconds fiber_sched_algorithm::m_expires = WAIT_INTERVAL_SHORT;
+
+}  // legacy
+
+using bench_clock = std::chrono::steady_clock;
+
+/// Let the old algorithm count requests like the server did
+template <typename Algo>
+void count_request() {}
+
+template <>
+void count_request<legacy::fiber_sched_algorithm>() {
+    legacy::fiber_sched_algorithm::update();
+}
+
+/// Return the CPU time of the calling thread in milliseconds
+double thread_cpu_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+struct result {
+    /// CPU time of the worker in percent of one core while idle
+    double idle_cpu;
+    /// CPU time of the worker in percent of one core while handlers get posted
+    double wakeup_cpu;
+    /// Wakeup latencies in microseconds
+    std::vector<double> latencies;
+};
+
+/// Run a worker thread with the scheduling algorithm, measure its CPU time while idle and the wakeup latency of a
+/// fiber after quiet periods
+template <typename Algo>
+result run(std::chrono::milliseconds idle, std::size_t wakeups, std::chrono::milliseconds quiet) {
+    result res;
+    boost::asio::io_service iosvc;
+    boost::asio::io_service::work work(iosvc);
+
+    // hands the promise the fiber waits for to the main thread
+    std::mutex mtx;
+    std::condition_variable cv;
+    boost::fibers::promise<bench_clock::time_point>* waiting = nullptr;
+    double cpu_ms = 0;
+    double wakeup_cpu_ms = 0;
+
+    std::thread worker([&] {
+        boost::fibers::use_scheduling_algorithm<Algo>(iosvc);
+        boost::fibers::fiber([&] {
+            // a request came in, then the worker idles
+            count_request<Algo>();
+            auto cpu_start = thread_cpu_ms();
+            boost::this_fiber::sleep_for(idle);
+            cpu_ms = thread_cpu_ms() - cpu_start;
+
+            cpu_start = thread_cpu_ms();
+            for (std::size_t i = 0; i < wakeups; ++i) {
+                boost::fibers::promise<bench_clock::time_point> promise;
+                auto future = promise.get_future();
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    waiting = &promise;
+                }
+                cv.notify_one();
+                auto posted = future.get();
+                res.latencies.push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - posted).count() / 1e3);
+                count_request<Algo>();
+            }
+            wakeup_cpu_ms = thread_cpu_ms() - cpu_start;
+            iosvc.stop();
+        }).detach();
+        iosvc.run();
+    });
+
+    bench_clock::time_point start;
+    for (std::size_t i = 0; i < wakeups; ++i) {
+        boost::fibers::promise<bench_clock::time_point>* promise;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return nullptr != waiting; });
+            promise = waiting;
+            waiting = nullptr;
+        }
+        if (0 == i) {
+            start = bench_clock::now();
+        }
+        std::this_thread::sleep_for(quiet);
+        auto posted = bench_clock::now();
+        // the handler runs on the worker thread, like the completion handler of an I/O operation
+        iosvc.post([promise, posted] { promise->set_value(posted); });
+    }
+    worker.join();
+    auto wall_ms = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count() / 1e3;
+    res.idle_cpu = 100.0 * cpu_ms / idle.count();
+    res.wakeup_cpu = 100.0 * wakeup_cpu_ms / wall_ms;
+    return res;
+}
+
+double percentile(std::vector<double> v, double p) {
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, static_cast<std::size_t>(p * v.size()))];
+}
+
+void print(const char* name, const result& r) {
+    std::printf("%-16s idle CPU %6.2f %%, CPU with requests %6.2f %%, wakeup latency p50 %9.1f us, p99 %9.1f us\n",
+                name, r.idle_cpu, r.wakeup_cpu, percentile(r.latencies, 0.5), percentile(r.latencies, 0.99));
+}
+
+int main(int argc, char** argv) {
+    std::size_t idle_s = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 3;
+    std::size_t wakeups = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 200;
+    if (idle_s == 0 || wakeups == 0) {
+        std::fprintf(stderr, "usage: %s [idle seconds] [wakeups]\n", argv[0]);
+        return 1;
+    }
+    auto idle = std::chrono::milliseconds(idle_s * 1000);
+    for (auto quiet : {std::chrono::milliseconds(0), std::chrono::milliseconds(5), std::chrono::milliseconds(50)}) {
+        std::printf("%zu s idle, %zu wakeups after %d ms quiet\n", idle_s, wakeups, static_cast<int>(quiet.count()));
+        print("polling", run<legacy::fiber_sched_algorithm>(idle, wakeups, quiet));
+        print("run_one/notify", run<petrel::fiber_sched_algorithm>(idle, wakeups, quiet));
+    }
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+// Compares the memory usage and the lookup latency of the radix tree path_set with the 256-wide character tree the
+// router used before. The throughput of requests without a route (404) is compared with hits, the old router threw
+// and caught an exception for each of them.
+//
+// Usage: bench_router [routes] [lookups]
+
+#include "router.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+/// Bytes currently allocated via operator new
+std::size_t g_allocated = 0;
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    // keep the size in front of the block, so operator delete can count it
+    auto* p = static_cast<std::size_t*>(std::malloc(size + alignof(std::max_align_t)));
+    if (nullptr == p) {
+        throw std::bad_alloc();
+    }
+    *p = size;
+    g_allocated += size;
+    return reinterpret_cast<char*>(p) + alignof(std::max_align_t);
+}
+
+void operator delete(void* ptr) noexcept {
+    if (nullptr != ptr) {
+        auto* p = reinterpret_cast<std::size_t*>(static_cast<char*>(ptr) - alignof(std::max_align_t));
+        g_allocated -= *p;
+        std::free(p);
+    }
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete[](void* ptr) noexcept { operator delete(ptr); }
+
+namespace legacy {
+
+/// The character tree of the old router: every node has 256 children, one per character
+template <typename Func>
+struct path_node {
+    using func_type = Func;
+    bool term = false;
+    func_type func;
+    path_node* next = nullptr;
+    ~path_node() {
+        if (nullptr != next) {
+            delete[] next;
+        }
+    }
+};
+
+template <typename Node>
+class path_set {
+  public:
+    using node_type = Node;
+    using func_type = typename node_type::func_type;
+
+    node_type& insert(const std::string& path, func_type func) {
+        auto* next = root;
+        for (std::size_t i = 0; i < path.length(); ++i) {
+            std::uint8_t c = path[i];
+            auto& node = next[c];
+            if (i == path.length() - 1) {
+                node.term = true;
+                node.func = func;
+                return node;
+            } else {
+                if (nullptr == node.next) {
+                    node.next = new node_type[256];
+                }
+                next = node.next;
+            }
+        }
+        throw std::runtime_error("insert failed");
+    }
+
+    func_type& find(const std::string& path) {
+        auto* next = root;
+        node_type* found = nullptr;
+        for (std::size_t i = 0; i < path.length(); ++i) {
+            std::uint8_t c = path[i];
+            auto& node = next[c];
+            if (node.term) {
+                found = &node;
+            }
+            if (nullptr == node.next) {
+                break;
+            }
+            next = node.next;
+        }
+        if (nullptr != found) {
+            return found->func;
+        }
+        throw std::runtime_error("find failed");
+    }
+
+  private:
+    node_type root[256];
+};
+
+}  // legacy
+
+using func_type = std::function<void()>;
+using radix_set = petrel::path_set<petrel::path_node<func_type>>;
+using legacy_set = legacy::path_set<legacy::path_node<func_type>>;
+
+using bench_clock = std::chrono::steady_clock;
+
+/// Route paths that share prefixes like the routes of a typical API
+std::vector<std::string> make_routes(std::size_t n) {
+    static const char* resources[] = {"users", "orders", "products", "invoices", "sessions", "reports"};
+    std::vector<std::string> routes;
+    routes.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        routes.push_back("/api/v" + std::to_string(i % 3 + 1) + "/" + resources[i % 6] + std::to_string(i / 6) +
+                         "/items");
+    }
+    return routes;
+}
+
+/// Request paths that hit the routes, with a suffix after the route prefix
+std::vector<std::string> make_requests(const std::vector<std::string>& routes) {
+    std::vector<std::string> paths;
+    paths.reserve(routes.size());
+    for (std::size_t i = 0; i < routes.size(); ++i) {
+        paths.push_back(routes[i] + "/" + std::to_string(i * 7919 % 100000) + "?page=2");
+    }
+    return paths;
+}
+
+/// Request paths that do not match any route
+std::vector<std::string> make_misses(std::size_t n) {
+    std::vector<std::string> paths;
+    paths.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        paths.push_back("/favicon" + std::to_string(i) + ".ico");
+    }
+    return paths;
+}
+
+/// Run lookups over paths and return the average latency in nanoseconds
+template <typename F>
+double measure(const std::vector<std::string>& paths, std::size_t lookups, F&& lookup) {
+    std::size_t found = 0;
+    auto start = bench_clock::now();
+    for (std::size_t i = 0; i < lookups; ++i) {
+        found += lookup(paths[i % paths.size()]);
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+    if (found == 0) {
+        std::printf("no lookup succeeded\n");
+    }
+    return static_cast<double>(ns) / lookups;
+}
+
+int main(int argc, char** argv) {
+    std::size_t num_routes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200;
+    std::size_t lookups = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000000;
+    if (num_routes == 0 || lookups == 0) {
+        std::fprintf(stderr, "usage: %s [routes] [lookups]\n", argv[0]);
+        return 1;
+    }
+    auto routes = make_routes(num_routes);
+    auto requests = make_requests(routes);
+    func_type noop = [] {};
+
+    auto before = g_allocated;
+    auto* radix = new radix_set;
+    for (auto& r : routes) {
+        radix->insert(r, noop);
+    }
+    auto radix_bytes = g_allocated - before;
+
+    before = g_allocated;
+    auto* old = new legacy_set;
+    for (auto& r : routes) {
+        old->insert(r, noop);
+    }
+    auto legacy_bytes = g_allocated - before;
+
+    std::printf("%zu routes, %zu lookups\n", num_routes, lookups);
+    std::printf("memory:  radix tree %10zu bytes, 256-wide tree %10zu bytes\n", radix_bytes, legacy_bytes);
+
+    auto radix_ns = measure(requests, lookups, [radix](const std::string& p) { return nullptr != radix->find(p); });
+    auto legacy_ns = measure(requests, lookups, [old](const std::string& p) { return nullptr != old->find(p); });
+    std::printf("latency: radix tree %10.1f ns,    256-wide tree %10.1f ns\n", radix_ns, legacy_ns);
+
+    // 404 vs. hit: find_route falls back to the 404 function without an exception, the old router caught the
+    // exception of its path_set
+    petrel::router router;
+    for (auto& r : routes) {
+        router.add_route(r, [](petrel::request::pointer) {});
+    }
+    petrel::router::route_func_type not_found = [](petrel::request::pointer) {};
+    auto misses = make_misses(num_routes);
+    auto router_lookup = [&router](const std::string& p) { return nullptr != router.find_route(p, "GET"); };
+    auto legacy_lookup = [old, &not_found](const std::string& p) -> bool {
+        try {
+            return nullptr != old->find(p);
+        } catch (std::runtime_error&) {
+            return nullptr != not_found;
+        }
+    };
+    auto per_sec = [](double ns) { return 1e9 / ns; };
+    std::printf("router hits:   %12.0f lookups/s, old router %12.0f lookups/s\n",
+                per_sec(measure(requests, lookups, router_lookup)), per_sec(measure(requests, lookups, legacy_lookup)));
+    std::printf("router misses: %12.0f lookups/s, old router %12.0f lookups/s\n",
+                per_sec(measure(misses, lookups, router_lookup)), per_sec(measure(misses, lookups, legacy_lookup)));
+
+    delete radix;
+    delete old;
+    return 0;
+}
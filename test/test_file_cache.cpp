@@ -101,6 +101,65 @@ BOOST_AUTO_TEST_CASE(test_cache) {
     remove_all("/tmp/petrel-test");
 }
 
+BOOST_AUTO_TEST_CASE(test_cache_budget) {
+    // log::init();
+    set_log_tag("test");
+
+    create_directories("/tmp/petrel-test");
+
+    std::ofstream of;
+    of.open("/tmp/petrel-test/a");
+    of << "aaaaaaaaaa";
+    of.close();
+    of.open("/tmp/petrel-test/b");
+    of << "bbbbbbbbbb";
+    of.close();
+    of.open("/tmp/petrel-test/big");
+    of << std::string(100, 'x');
+    of.close();
+
+    // room for one small file, the big file is streamed
+    file_cache cache(1, 16, 64);
+    cache.add_directory("/tmp/petrel-test");
+    BOOST_CHECK(cache.cached_bytes() == 0);
+
+    auto a = cache.get_file("/tmp/petrel-test/a");
+    BOOST_CHECK(a != nullptr);
+    BOOST_CHECK(cache.cached_bytes() == 10);
+    auto b = cache.get_file("/tmp/petrel-test/b");
+    BOOST_CHECK(b != nullptr);
+    BOOST_CHECK(!strncmp(b->data().data(), "bbbbbbbbbb", 10));
+    BOOST_CHECK(cache.cached_bytes() == 10);
+    // the evicted file stays valid for its users and gets loaded again
+    BOOST_CHECK(!strncmp(a->data().data(), "aaaaaaaaaa", 10));
+    a = cache.get_file("/tmp/petrel-test/a");
+    BOOST_CHECK(a != nullptr);
+    BOOST_CHECK(!strncmp(a->data().data(), "aaaaaaaaaa", 10));
+    BOOST_CHECK(cache.cached_bytes() == 10);
+
+    auto big = cache.get_file("/tmp/petrel-test/big");
+    BOOST_CHECK(big != nullptr);
+    BOOST_CHECK(big->streamed());
+    BOOST_CHECK(big->size() == 100);
+    BOOST_CHECK(big->data().empty());
+    BOOST_CHECK(big->fd() >= 0);
+    BOOST_CHECK(cache.cached_bytes() == 10);
+    // the streamed file is kept until it changes
+    BOOST_CHECK(cache.get_file("/tmp/petrel-test/big") == big);
+    of.open("/tmp/petrel-test/big");
+    of << std::string(200, 'y');
+    of.close();
+    cache.add_file("/tmp/petrel-test/big");
+    auto big2 = cache.get_file("/tmp/petrel-test/big");
+    BOOST_CHECK(big2 != nullptr);
+    BOOST_CHECK(big2 != big);
+    BOOST_CHECK(big2->streamed());
+    BOOST_CHECK(big2->size() == 200);
+    BOOST_CHECK(cache.cached_bytes() == 10);
+
+    remove_all("/tmp/petrel-test");
+}
+
 BOOST_AUTO_TEST_CASE(test_server) {
     // log::init();
     set_log_tag("test");
@@ -111,15 +170,23 @@ BOOST_AUTO_TEST_CASE(test_server) {
     of.open("/tmp/petrel-test/test");
     of << "test";
     of.close();
+    of.open("/tmp/petrel-test/test.js");
+    for (int i = 0; i < 100; ++i) {
+        of << "console.log('test');\n";
+    }
+    of.close();
+    of.open("/tmp/petrel-test/big");
+    of << std::string(64 * 1024, 'x');
+    of.close();
 
     const char* argv[] = {"test",         "--server.listen=localhost", "--server.port=18588", "--server.http1",
-                          "--lua.root=.", "--lua.statebuffer=5"};
+                          "--lua.root=.", "--lua.statebuffer=5",       "--files.stream-threshold=32"};
     options::parse(sizeof(argv) / sizeof(const char*), argv);
     server s;
     auto& se = s.get_lua_engine().state_manager();
     se.add_lua_code(
         "function bootstrap() "
-        "  petrel.add_directory_route(\"/files/\", \"/tmp/petrel-test\") "
+        "  petrel.add_directory_route(\"/files/\", \"/tmp/petrel-test\", {cache_control = \"max-age=60\"}) "
         "end ");
 
     // start server
@@ -176,6 +243,86 @@ BOOST_AUTO_TEST_CASE(test_server) {
 
     ce.destroy_state(Lex);
 
+    // conditional requests
+    {
+        auto raw_get = [](const std::string& hdrs, const std::string& file = "test") {
+            io_service iosvc_raw;
+            ip::tcp::socket sock(iosvc_raw);
+            ip::tcp::resolver resolver(iosvc_raw);
+            boost::asio::connect(sock, resolver.resolve(ip::tcp::resolver::query("localhost", "18588")));
+            std::string req =
+                "GET /files/" + file + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n" + hdrs + "\r\n";
+            boost::asio::write(sock, buffer(req));
+            boost::system::error_code ec;
+            streambuf buf;
+            boost::asio::read(sock, buf, ec);
+            return std::string(buffers_begin(buf.data()), buffers_end(buf.data()));
+        };
+        auto res = raw_get("");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 200") == 0, res);
+        BOOST_CHECK_MESSAGE(res.find("cache-control: max-age=60\r\n") != std::string::npos, res);
+        auto pos = res.find("etag: ");
+        BOOST_CHECK(pos != std::string::npos);
+        auto etag = res.substr(pos + 6, res.find("\r\n", pos) - pos - 6);
+        pos = res.find("last-modified: ");
+        BOOST_CHECK(pos != std::string::npos);
+        auto last_modified = res.substr(pos + 15, res.find("\r\n", pos) - pos - 15);
+
+        res = raw_get("If-None-Match: \"xyz\", " + etag + "\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 304") == 0, res);
+        BOOST_CHECK_MESSAGE(res.substr(res.size() - 4) == "\r\n\r\n", res);
+        res = raw_get("If-None-Match: \"xyz\"\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 200") == 0, res);
+        res = raw_get("If-Modified-Since: " + last_modified + "\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 304") == 0, res);
+        res = raw_get("If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 200") == 0, res);
+
+        // compressed variants
+        res = raw_get("Accept-Encoding: deflate, gzip\r\n", "test.js");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 200") == 0, res);
+        BOOST_CHECK_MESSAGE(res.find("content-encoding: gzip\r\n") != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.find("vary: accept-encoding\r\n") != std::string::npos, res);
+        res = raw_get("Accept-Encoding: gzip;q=0\r\n", "test.js");
+        BOOST_CHECK_MESSAGE(res.find("content-encoding") == std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.find("vary: accept-encoding\r\n") != std::string::npos, res);
+        res = raw_get("Accept-Encoding: gzip\r\n");
+        BOOST_CHECK_MESSAGE(res.find("content-encoding") == std::string::npos, res);
+
+        // ranges
+        res = raw_get("Range: bytes=1-2\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 206") == 0, res);
+        BOOST_CHECK_MESSAGE(res.find("content-range: bytes 1-2/4\r\n") != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.substr(res.size() - 6) == "\r\n\r\nes", res);
+        res = raw_get("Range: bytes=0-0,-1\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 206") == 0, res);
+        BOOST_CHECK_MESSAGE(res.find("multipart/byteranges; boundary=") != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.find("content-range: bytes 0-0/4\r\n\r\nt\r\n") != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.find("content-range: bytes 3-3/4\r\n\r\nt\r\n") != std::string::npos, res);
+        res = raw_get("Range: bytes=10-\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 416") == 0, res);
+        BOOST_CHECK_MESSAGE(res.find("content-range: bytes */4\r\n") != std::string::npos, res);
+        res = raw_get("Range: bytes=1-2\r\nIf-Range: \"xyz\"\r\n");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 200") == 0, res);
+
+        // path normalization
+        res = raw_get("", "sub/../%74est?x=1");
+        BOOST_CHECK_MESSAGE(res.substr(res.size() - 8) == "\r\n\r\ntest", res);
+        res = raw_get("", "../petrel-test/test");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 404") == 0, res);
+        res = raw_get("", "%2e%2e/petrel-test/test");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 404") == 0, res);
+
+        // streamed files
+        res = raw_get("", "big");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 200") == 0, res.substr(0, 256));
+        BOOST_CHECK_MESSAGE(res.find("content-length: 65536\r\n") != std::string::npos, res.substr(0, 256));
+        BOOST_CHECK(res.substr(res.size() - 64 * 1024 - 4) == "\r\n\r\n" + std::string(64 * 1024, 'x'));
+        res = raw_get("Range: bytes=-6\r\n", "big");
+        BOOST_CHECK_MESSAGE(res.find("HTTP/1.1 206") == 0, res);
+        BOOST_CHECK_MESSAGE(res.substr(res.size() - 10) == "\r\n\r\nxxxxxx", res);
+    }
+
     s.impl()->stop();
     s.impl()->join();
 
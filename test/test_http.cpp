@@ -5,6 +5,7 @@
  * Author: Andreas Pohl
  */
 
+#include "builtin/connection_pool.h"
 #include "builtin/http_client.h"
 #include "fiber_sched_algorithm.h"
 #include "make_unique.h"
@@ -38,6 +39,11 @@ BOOST_AUTO_TEST_CASE(test_http) {
         "function bootstrap() "
         "  petrel.add_route(\"/\", \"handler\") "
         "  petrel.add_route(\"/post/\", \"handler_post\") "
+        "  petrel.add_route(\"/slow/\", \"handler_slow\") "
+        "  petrel.add_route(\"/stream/\", \"handler_stream\") "
+        "  petrel.add_route(\"/nocontent/\", \"handler_nocontent\") "
+        "  petrel.add_route(\"/keep/\", \"handler_keep\") "
+        "  petrel.add_route(\"/trickle/\", \"handler_trickle\") "
         "end "
         "function handler(req, res) "
         "  res.content = \"test\" "
@@ -47,6 +53,36 @@ BOOST_AUTO_TEST_CASE(test_http) {
         "function handler_post(req, res) "
         "  for i=1,10000 do res.content = res.content .. req.content end "
         "  return res "
+        "end "
+        "function handler_slow(req, res) "
+        "  petrel.sleep_millis(100) "
+        "  res.content = \"slow\" "
+        "  return res "
+        "end "
+        "function handler_stream(req, res) "
+        "  res.headers[\"x-hdr-test\"] = \"hdr-val\" "
+        "  res:write(\"chunk1\") "
+        "  res:write(\"chunk22\") "
+        "  res:finish() "
+        "end "
+        "function handler_trickle(req, res) "
+        "  for i=1,5 do "
+        "    res:write(\"x\") "
+        "    petrel.sleep_millis(40) "
+        "  end "
+        "  res:finish() "
+        "end "
+        "function handler_keep(req, res) "
+        "  local prev = kept "
+        "  kept = res "
+        "  res.content = req.path "
+        "  if prev then res.content = res.content .. \",\" .. prev.content end "
+        "  return res "
+        "end "
+        "function handler_nocontent(req, res) "
+        "  res.status = 204 "
+        "  res.content = \"ignored\" "
+        "  return res "
         "end ");
 
     // start server
@@ -72,10 +108,66 @@ BOOST_AUTO_TEST_CASE(test_http) {
         "  h = http_client() "
         "  h:connect(\"localhost\", \"18585\") "
         "  return h:post(\"/post/\", \"post_data\") "
+        "end "
+        "function test_pool() "
+        "  local h1 = http_client() "
+        "  h1:connect(\"localhost\", \"18585\") "
+        "  h1:get(\"/\") "
+        "  h1:disconnect() "
+        "  local h2 = http_client() "
+        "  h2:connect(\"localhost\", \"18585\") "
+        "  local status, content = h2:get(\"/\") "
+        "  h2:disconnect() "
+        "  return status, content "
+        "end "
+        "function test_chunked() "
+        "  local h = http_client() "
+        "  h:connect(\"localhost\", \"18585\") "
+        "  local status, content, headers = h:get(\"/stream/\") "
+        "  h:disconnect() "
+        "  return status, content, headers[\"x-hdr-test\"] "
+        "end "
+        "function test_keep() "
+        "  local h = http_client() "
+        "  h:connect(\"localhost\", \"18585\") "
+        "  h:get(\"/keep/a\") "
+        "  local status, content = h:get(\"/keep/b\") "
+        "  h:disconnect() "
+        "  return status, content "
+        "end "
+        "function test_interim() "
+        "  local h = http_client() "
+        "  h:connect(\"127.0.0.1\", \"18590\") "
+        "  local status, content, headers = h:get(\"/\") "
+        "  h:disconnect() "
+        "  return status, content, headers[\"link\"] == nil "
+        "end "
+        "function test_multi_get() "
+        "  local r = http_client.multi_get({ "
+        "    {host = \"localhost\", port = \"18585\", path = \"/slow/\"}, "
+        "    {host = \"localhost\", port = \"18585\"}, "
+        "    {host = \"localhost\", port = \"18585\", path = \"/slow/\", timeout = 20}, "
+        "    {host = \"localhost\", port = \"18585\", path = \"/trickle/\", timeout = 100}}, 1000) "
+        "  return r[1].status, r[1].content, r[2].content, r[3].error ~= nil, r[4].error ~= nil "
         "end ");
     auto Lex = ce.create_state();
     log_info("state created");
 
+    // an upstream that sends interim responses before the final one
+    io_service iosvc_up;
+    ip::tcp::acceptor acceptor(iosvc_up, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 18590));
+    std::thread upstream([&] {
+        ip::tcp::socket sock(iosvc_up);
+        acceptor.accept(sock);
+        streambuf buf;
+        boost::asio::read_until(sock, buf, "\r\n\r\n");
+        std::string res =
+            "HTTP/1.1 100 Continue\r\n\r\n"
+            "HTTP/1.1 103 Early Hints\r\nLink: </style.css>; rel=preload\r\n\r\n"
+            "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\nfinal";
+        boost::asio::write(sock, buffer(res));
+    });
+
     std::thread([&] {
         fiber([&] {
             set_log_tag("test_clnt");
@@ -126,15 +218,150 @@ BOOST_AUTO_TEST_CASE(test_http) {
             }
             log_info("post done");
 
+            // the second client has to reuse the connection of the first one
+            lua_getglobal(Lex.L, "test_pool");
+            if (lua_pcall(Lex.L, 0, 2, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -2) == 200);
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -1)) == "test");
+                BOOST_CHECK(use_service<connection_pool>(iosvc).idle("localhost:18585") == 1);
+            }
+            log_info("pool done");
+
+            // chunked bodies get decoded, the connection can be reused afterwards
+            lua_getglobal(Lex.L, "test_chunked");
+            if (lua_pcall(Lex.L, 0, 3, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -3) == 200);
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -2)) == "chunk1chunk22");
+                BOOST_CHECK(lua_isstring(Lex.L, -1) && std::string(lua_tostring(Lex.L, -1)) == "hdr-val");
+                BOOST_CHECK(use_service<connection_pool>(iosvc).idle("localhost:18585") == 1);
+            }
+            log_info("chunked done");
+
+            // a response table kept by a handler must not change with the next request
+            lua_getglobal(Lex.L, "test_keep");
+            if (lua_pcall(Lex.L, 0, 2, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -2) == 200);
+                BOOST_CHECK_MESSAGE(std::string(lua_tostring(Lex.L, -1)) == "/keep/b,/keep/a",
+                                    "content was '" << lua_tostring(Lex.L, -1) << "'");
+            }
+            log_info("keep done");
+
+            // interim responses are skipped, their headers do not show up
+            lua_getglobal(Lex.L, "test_interim");
+            if (lua_pcall(Lex.L, 0, 3, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -3) == 200);
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -2)) == "final");
+                BOOST_CHECK(lua_toboolean(Lex.L, -1));
+            }
+            log_info("interim done");
+
+            // the requests run concurrently, the third one times out. The fourth one gets data more often than its
+            // timeout, but the timeout covers the whole request.
+            lua_getglobal(Lex.L, "test_multi_get");
+            if (lua_pcall(Lex.L, 0, 5, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -5) == 200);
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -4)) == "slow");
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -3)) == "test");
+                BOOST_CHECK(lua_toboolean(Lex.L, -2));
+                BOOST_CHECK(lua_toboolean(Lex.L, -1));
+            }
+            log_info("multi_get done");
+
             iosvc.stop();
         }).detach();
 
         use_scheduling_algorithm<fiber_sched_algorithm>(iosvc);
         iosvc.run();
     }).join();
+    upstream.join();
 
     ce.destroy_state(Lex);
 
+    // pipelining: the slow response has to be sent before the fast one
+    {
+        io_service iosvc_raw;
+        ip::tcp::socket sock(iosvc_raw);
+        ip::tcp::resolver resolver(iosvc_raw);
+        boost::asio::connect(sock, resolver.resolve(ip::tcp::resolver::query("localhost", "18585")));
+        std::string reqs =
+            "GET /slow/ HTTP/1.1\r\nHost: localhost\r\n\r\n"
+            "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        boost::asio::write(sock, buffer(reqs));
+        boost::system::error_code ec;
+        streambuf buf;
+        boost::asio::read(sock, buf, ec);
+        BOOST_CHECK(ec == error::eof);
+        std::string res(buffers_begin(buf.data()), buffers_end(buf.data()));
+        auto pos_slow = res.find("\r\n\r\nslow");
+        auto pos_fast = res.find("\r\n\r\ntest");
+        BOOST_CHECK(pos_slow != std::string::npos);
+        BOOST_CHECK(pos_fast != std::string::npos);
+        BOOST_CHECK_MESSAGE(pos_slow < pos_fast, "responses out of order: " << res);
+    }
+    log_info("pipelining done");
+
+    // responses to HEAD requests and 204 responses have no body, the next response has to follow the head directly
+    {
+        io_service iosvc_raw;
+        ip::tcp::socket sock(iosvc_raw);
+        ip::tcp::resolver resolver(iosvc_raw);
+        boost::asio::connect(sock, resolver.resolve(ip::tcp::resolver::query("localhost", "18585")));
+        std::string reqs =
+            "HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+            "GET /nocontent/ HTTP/1.1\r\nHost: localhost\r\n\r\n"
+            "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        boost::asio::write(sock, buffer(reqs));
+        boost::system::error_code ec;
+        streambuf buf;
+        boost::asio::read(sock, buf, ec);
+        BOOST_CHECK(ec == error::eof);
+        std::string res(buffers_begin(buf.data()), buffers_end(buf.data()));
+        auto end_head = res.find("\r\n\r\n");
+        BOOST_REQUIRE_MESSAGE(end_head != std::string::npos, res);
+        // the HEAD response keeps the content-length of the GET response
+        BOOST_CHECK_MESSAGE(res.substr(0, end_head).find("content-length: 4") != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.compare(end_head + 4, 12, "HTTP/1.1 204") == 0, res);
+        end_head = res.find("\r\n\r\n", end_head + 4);
+        BOOST_REQUIRE_MESSAGE(end_head != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.compare(end_head + 4, 12, "HTTP/1.1 200") == 0, res);
+        BOOST_CHECK_MESSAGE(res.find("ignored") == std::string::npos, res);
+        end_head = res.find("\r\n\r\n", end_head + 4);
+        BOOST_REQUIRE_MESSAGE(end_head != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.substr(end_head + 4) == "test", res);
+    }
+    log_info("head done");
+
+    // chunked response
+    {
+        io_service iosvc_raw;
+        ip::tcp::socket sock(iosvc_raw);
+        ip::tcp::resolver resolver(iosvc_raw);
+        boost::asio::connect(sock, resolver.resolve(ip::tcp::resolver::query("localhost", "18585")));
+        std::string req = "GET /stream/ HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        boost::asio::write(sock, buffer(req));
+        boost::system::error_code ec;
+        streambuf buf;
+        boost::asio::read(sock, buf, ec);
+        BOOST_CHECK(ec == error::eof);
+        std::string res(buffers_begin(buf.data()), buffers_end(buf.data()));
+        BOOST_CHECK_MESSAGE(res.find("transfer-encoding: chunked\r\n") != std::string::npos, res);
+        BOOST_CHECK_MESSAGE(res.find("x-hdr-test: hdr-val\r\n") != std::string::npos, res);
+        auto pos = res.find("\r\n\r\n");
+        BOOST_CHECK(pos != std::string::npos);
+        BOOST_CHECK_MESSAGE(res.substr(pos + 4) == "6\r\nchunk1\r\n7\r\nchunk22\r\n0\r\n\r\n", res);
+    }
+    log_info("chunked done");
+
     s.impl()->stop();
     s.impl()->join();
     log_info("test done");
@@ -6,6 +6,7 @@
  */
 
 #include "builtin/http2_client.h"
+#include "builtin/http2_session_pool.h"
 #include "fiber_sched_algorithm.h"
 #include "options.h"
 #include "server.h"
@@ -14,6 +15,14 @@
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <boost/asio.hpp>
 #include <boost/fiber/all.hpp>
 
@@ -22,10 +31,95 @@ using namespace petrel::lib;
 using namespace boost::asio;
 using namespace boost::fibers;
 
+/// Relays connections to the server, so the test can drop them like a server that goes away
+class relay {
+  public:
+    relay(unsigned short port, const std::string& target)
+        : m_acceptor(m_iosvc, ip::tcp::endpoint(ip::address_v4::loopback(), port)), m_target(target) {
+        accept();
+        m_thread = std::thread([this] { m_iosvc.run(); });
+    }
+
+    ~relay() {
+        m_iosvc.stop();
+        m_thread.join();
+    }
+
+    /// Close all relayed connections
+    void drop() {
+        m_iosvc.post([this] {
+            for (auto& c : m_conns) {
+                c->close();
+            }
+            m_conns.clear();
+        });
+    }
+
+    /// The number of accepted connections
+    std::atomic<int> accepted{0};
+
+  private:
+    struct conn {
+        explicit conn(io_service& iosvc) : client(iosvc), server(iosvc) {}
+        ip::tcp::socket client;
+        ip::tcp::socket server;
+        std::array<char, 16 * 1024> up;
+        std::array<char, 16 * 1024> down;
+
+        void close() {
+            boost::system::error_code ec;
+            client.close(ec);
+            server.close(ec);
+        }
+    };
+
+    io_service m_iosvc;
+    ip::tcp::acceptor m_acceptor;
+    std::string m_target;
+    std::vector<std::shared_ptr<conn>> m_conns;
+    std::thread m_thread;
+
+    void accept() {
+        auto c = std::make_shared<conn>(m_iosvc);
+        m_acceptor.async_accept(c->client, [this, c](const boost::system::error_code& ec) {
+            if (ec) {
+                return;
+            }
+            ++accepted;
+            ip::tcp::resolver resolver(m_iosvc);
+            boost::asio::connect(c->server, resolver.resolve(ip::tcp::resolver::query("localhost", m_target)));
+            m_conns.push_back(c);
+            forward(c, c->client, c->server, c->up);
+            forward(c, c->server, c->client, c->down);
+            accept();
+        });
+    }
+
+    static void forward(std::shared_ptr<conn> c, ip::tcp::socket& from, ip::tcp::socket& to,
+                        std::array<char, 16 * 1024>& buf) {
+        from.async_read_some(buffer(buf), [c, &from, &to, &buf](const boost::system::error_code& ec, std::size_t n) {
+            if (ec) {
+                c->close();
+                return;
+            }
+            async_write(to, buffer(buf, n), [c, &from, &to, &buf](const boost::system::error_code& ec, std::size_t) {
+                if (!ec) {
+                    forward(c, from, to, buf);
+                }
+            });
+        });
+    }
+};
+
 BOOST_AUTO_TEST_CASE(test_http2) {
     // options
-    const char* argv[] = {"test", "--server.listen=localhost", "--server.port=18586", "--lua.root=.",
-                          "--lua.statebuffer=5"};
+    const char* argv[] = {"test",
+                          "--server.listen=localhost",
+                          "--server.port=18586",
+                          "--lua.root=.",
+                          "--lua.statebuffer=5",
+                          "--client.http2-max-streams=2",
+                          "--client.keepalive-timeout=1"};
     options::parse(sizeof(argv) / sizeof(const char*), argv);
 
     // log::init();
@@ -36,6 +130,27 @@ BOOST_AUTO_TEST_CASE(test_http2) {
     se.add_lua_code(
         "function bootstrap() "
         "  petrel.add_route(\"/\", \"handler\") "
+        "  petrel.add_route(\"/echo/\", \"handler_echo\") "
+        "  petrel.add_route(\"/slow/\", \"handler_slow\") "
+        "  petrel.add_route(\"/items/\", \"handler_put\", \"PUT\") "
+        "  petrel.add_route(\"/items/\", \"handler_delete\", \"DELETE\") "
+        "end "
+        "function handler_put(req, res) "
+        "  res.content = \"put:\" .. req.content "
+        "  return res "
+        "end "
+        "function handler_delete(req, res) "
+        "  res.status = 204 "
+        "  return res "
+        "end "
+        "function handler_slow(req, res) "
+        "  petrel.sleep_millis(100) "
+        "  res.content = \"slow\" "
+        "  return res "
+        "end "
+        "function handler_echo(req, res) "
+        "  res.content = req.content "
+        "  return res "
         "end "
         "function handler(req, res) "
         "  res.content = \"test\" "
@@ -61,10 +176,42 @@ BOOST_AUTO_TEST_CASE(test_http2) {
         "  h = http2_client() "
         "  h:connect(\"localhost\", \"18586\") "
         "  return h:get(\"/\") "
+        "end "
+        "function test_multiplex() "
+        "  h = http2_client() "
+        "  h:connect(\"localhost\", \"18586\") "
+        "  local s1 = h:submit(\"POST\", \"/echo/\", \"a\\0b\", {[\"Content-Type\"] = \"application/octet-stream\"}) "
+        "  local s2 = h:submit(\"GET\", \"/\") "
+        "  local status2, content2, headers2 = h:wait(s2) "
+        "  local status1, content1 = h:wait(s1) "
+        "  return status1, content1, content2, headers2[\"x-hdr-test\"] "
+        "end "
+        "function test_methods() "
+        "  h = http2_client() "
+        "  h:connect(\"localhost\", \"18586\") "
+        "  local put_status, put_content = h:put(\"/items/1\", \"x\") "
+        "  local del_status = h:request(\"DELETE\", \"/items/1\") "
+        "  local patch_status = h:request(\"PATCH\", \"/items/1\", \"y\") "
+        "  return put_status, put_content, del_status, patch_status "
+        "end "
+        "function test_max_streams() "
+        "  local h = http2_client() "
+        "  h:connect(\"localhost\", \"18586\") "
+        "  local s1 = h:submit(\"GET\", \"/slow/\") "
+        "  local s2 = h:submit(\"GET\", \"/slow/\") "
+        "  local s3 = h:submit(\"GET\", \"/slow/\") "
+        "  return h:wait(s1), h:wait(s2), h:wait(s3) "
+        "end "
+        "function test_reconnect() "
+        "  local h = http2_client() "
+        "  h:connect(\"127.0.0.1\", \"18591\") "
+        "  return h:get(\"/\") "
         "end");
     auto Lex = ce.create_state();
     log_info("state created");
 
+    relay rel(18591, "18586");
+
     std::thread([&] {
         fiber([&] {
             set_log_tag("test_clnt");
@@ -86,6 +233,69 @@ BOOST_AUTO_TEST_CASE(test_http2) {
                 BOOST_CHECK_MESSAGE(content == "test", "'test' expected: content was '" << content << "'");
                 BOOST_CHECK(status == 200);
             }
+
+            // two streams on one session, the body contains a NUL byte
+            lua_getglobal(Lex.L, "test_multiplex");
+            if (lua_pcall(Lex.L, 0, 4, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -4) == 200);
+                std::size_t len;
+                const char* content = lua_tolstring(Lex.L, -3, &len);
+                BOOST_CHECK(std::string(content, len) == std::string("a\0b", 3));
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -2)) == "test");
+                BOOST_CHECK(lua_isstring(Lex.L, -1) && std::string(lua_tostring(Lex.L, -1)) == "hdr-val");
+            }
+            // per-method routes
+            lua_getglobal(Lex.L, "test_methods");
+            if (lua_pcall(Lex.L, 0, 4, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -4) == 200);
+                BOOST_CHECK(std::string(lua_tostring(Lex.L, -3)) == "put:x");
+                BOOST_CHECK(lua_tointeger(Lex.L, -2) == 204);
+                // no route for the method, the request falls through to the "/" route which only takes GET/POST
+                BOOST_CHECK(lua_tointeger(Lex.L, -1) == 501);
+            }
+            // all clients used the same pooled session
+            auto& pool = use_service<http2_session_pool>(iosvc);
+            BOOST_CHECK(pool.sessions("localhost:18586") == 1);
+
+            // the third stream exceeds the stream limit of the session and gets a new one
+            lua_getglobal(Lex.L, "test_max_streams");
+            if (lua_pcall(Lex.L, 0, 3, Lex.traceback_idx)) {
+                BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+            } else {
+                BOOST_CHECK(lua_tointeger(Lex.L, -3) == 200);
+                BOOST_CHECK(lua_tointeger(Lex.L, -2) == 200);
+                BOOST_CHECK(lua_tointeger(Lex.L, -1) == 200);
+            }
+            lua_settop(Lex.L, 0);
+            BOOST_CHECK(pool.sessions("localhost:18586") == 2);
+            log_info("max streams done");
+
+            // a connection dropped by the server is replaced
+            for (int i = 0; i < 2; ++i) {
+                lua_getglobal(Lex.L, "test_reconnect");
+                if (lua_pcall(Lex.L, 0, 2, Lex.traceback_idx)) {
+                    BOOST_CHECK_MESSAGE(false, "lua_pcall failed: " << lua_tostring(Lex.L, -1));
+                } else {
+                    BOOST_CHECK(lua_tointeger(Lex.L, -2) == 200);
+                    BOOST_CHECK(std::string(lua_tostring(Lex.L, -1)) == "test");
+                }
+                lua_settop(Lex.L, 0);
+                BOOST_CHECK(rel.accepted == i + 1);
+                BOOST_CHECK(pool.sessions("127.0.0.1:18591") == 1);
+                rel.drop();
+                boost::this_fiber::sleep_for(std::chrono::milliseconds(100));
+            }
+            log_info("reconnect done");
+
+            // idle sessions expire after the keepalive timeout
+            boost::this_fiber::sleep_for(std::chrono::milliseconds(1100));
+            BOOST_CHECK(nullptr == pool.acquire("localhost:18586"));
+            BOOST_CHECK(pool.sessions("localhost:18586") == 0);
+            log_info("idle expiry done");
             iosvc.stop();
             log_info("done");
         }).detach();
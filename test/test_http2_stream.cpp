@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+#include "options.h"
+#include "server.h"
+#include "server_impl.h"
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <future>
+#include <thread>
+#include <boost/asio.hpp>
+#include <nghttp2/asio_http2_client.h>
+#include <nghttp2/nghttp2.h>
+
+using namespace petrel;
+using namespace boost::asio;
+
+namespace http2 = nghttp2::asio_http2;
+
+BOOST_AUTO_TEST_CASE(test_http2_stream_reset) {
+    // options
+    const char* argv[] = {"test", "--server.listen=localhost", "--server.port=18589", "--lua.root=.",
+                          "--lua.statebuffer=5", "--server.http2-stream-body"};
+    options::parse(sizeof(argv) / sizeof(const char*), argv);
+
+    // create server and push some lua code, the handler starts its response and reads the body afterwards
+    server s;
+    auto& se = s.get_lua_engine().state_manager();
+    se.add_lua_code(
+        "function bootstrap() "
+        "  petrel.add_route(\"/upload/\", \"handler_upload\") "
+        "end "
+        "function handler_upload(req, res) "
+        "  res:write(\"started\") "
+        "  while req:read_body_chunk() do end "
+        "  return res "
+        "end");
+
+    // start server
+    s.impl()->init();
+    s.impl()->start();
+
+    set_log_tag("test_main");
+    log_info("server up");
+
+    // send a request with a body that never ends and reset the stream once the handler has started the response
+    bool got_response = false;
+    bool closed = false;
+    std::thread([&] {
+        io_service iosvc;
+        http2::client::session sess(iosvc, "localhost", "18589");
+        sess.on_connect([&](ip::tcp::resolver::iterator) {
+            boost::system::error_code ec;
+            auto* req = sess.submit(ec, "POST", "http://localhost:18589/upload/",
+                                    [](std::uint8_t*, std::size_t, std::uint32_t*) -> ssize_t {
+                                        return NGHTTP2_ERR_DEFERRED;
+                                    });
+            BOOST_REQUIRE(!ec);
+            req->on_response([&got_response, req](const http2::client::response& res) {
+                got_response = res.status_code() == 200;
+                req->cancel(NGHTTP2_CANCEL);
+            });
+            req->on_close([&closed, &sess](std::uint32_t) {
+                closed = true;
+                sess.shutdown();
+            });
+        });
+        sess.on_error([](const boost::system::error_code& ec) {
+            BOOST_CHECK_MESSAGE(false, "session error: " << ec.message());
+        });
+        iosvc.run();
+    }).join();
+    BOOST_CHECK(got_response);
+    BOOST_CHECK(closed);
+
+    // stopping the server waits for all handlers, the reset has to end the body the handler is waiting for
+    std::promise<void> promise;
+    auto stopped = promise.get_future();
+    std::thread([&s, &promise] {
+        s.impl()->stop();
+        s.impl()->join();
+        promise.set_value();
+    }).detach();
+    BOOST_REQUIRE_MESSAGE(stopped.wait_for(std::chrono::seconds(10)) == std::future_status::ready,
+                          "the handler still waits for the request body");
+    log_info("test done");
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2016 Andreas Pohl
+ * Licensed under MIT (see COPYING)
+ *
+ * Author: Andreas Pohl
+ */
+
+#include "fiber_sched_algorithm.h"
+#include "log.h"
+#include "options.h"
+#include "resolver_cache.h"
+
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/fiber/all.hpp>
+#include <petrel/fiber/yield.hpp>
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+using namespace petrel;
+using namespace boost::asio;
+using namespace boost::fibers;
+
+namespace bfa = boost::fibers::asio;
+
+BOOST_AUTO_TEST_CASE(test_resolver_cache) {
+    const char* argv[] = {"test", "--server.dns-cache-ttl=1", "--server.dns-cache-negative-ttl=60"};
+    options::parse(sizeof(argv) / sizeof(const char*), argv);
+    set_log_tag("test");
+
+    resolver_cache cache;
+    io_service iosvc;
+    io_service::work work(iosvc);
+
+    std::thread([&] {
+        fiber([&] {
+            // concurrent lookups of one host result in one query
+            std::vector<fiber> fibers;
+            std::vector<bool> found(8, false);
+            for (std::size_t i = 0; i < found.size(); ++i) {
+                fibers.emplace_back([&, i] {
+                    auto iter = cache.async_resolve<resolver_cache::tcp>(iosvc, "localhost", "80", bfa::yield);
+                    found[i] = iter != resolver_cache::tcp_cache::resolver_iterator();
+                });
+            }
+            for (auto& f : fibers) {
+                f.join();
+            }
+            for (bool f : found) {
+                BOOST_CHECK(f);
+            }
+            BOOST_CHECK_EQUAL(cache.lookups<resolver_cache::tcp>(), 1u);
+
+            // cached
+            cache.async_resolve<resolver_cache::tcp>(iosvc, "localhost", "80", bfa::yield);
+            BOOST_CHECK_EQUAL(cache.lookups<resolver_cache::tcp>(), 1u);
+
+            // failed lookups get cached too
+            boost::system::error_code ec1;
+            boost::system::error_code ec2;
+            cache.async_resolve<resolver_cache::tcp>(iosvc, "host.invalid", "80", bfa::yield[ec1]);
+            cache.async_resolve<resolver_cache::tcp>(iosvc, "host.invalid", "80", bfa::yield[ec2]);
+            BOOST_CHECK(ec1);
+            BOOST_CHECK(ec1 == ec2);
+            BOOST_CHECK_EQUAL(cache.lookups<resolver_cache::tcp>(), 2u);
+            BOOST_CHECK_THROW(cache.async_resolve<resolver_cache::tcp>(iosvc, "host.invalid", "80", bfa::yield),
+                              boost::system::system_error);
+
+            // a caller stops waiting at its deadline, the lookup completes for the others
+            boost::system::error_code ec3;
+            cache.async_resolve<resolver_cache::tcp>(iosvc, "localhost", "81", bfa::yield[ec3],
+                                                     resolver_cache::clock::now());
+            BOOST_CHECK(ec3 == error::timed_out);
+            auto iter = cache.async_resolve<resolver_cache::tcp>(iosvc, "localhost", "81", bfa::yield);
+            BOOST_CHECK(iter != resolver_cache::tcp_cache::resolver_iterator());
+            BOOST_CHECK_EQUAL(cache.lookups<resolver_cache::tcp>(), 3u);
+
+            iosvc.stop();
+        }).detach();
+
+        use_scheduling_algorithm<fiber_sched_algorithm>(iosvc);
+        iosvc.run();
+    }).join();
+}
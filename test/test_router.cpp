@@ -45,3 +45,66 @@ BOOST_AUTO_TEST_CASE(test_set_find) {
     find_and_exec(r, "/xxx");
     BOOST_CHECK_MESSAGE(r1, "/xxx not mapped to route /");
 }
+
+BOOST_AUTO_TEST_CASE(test_set_split) {
+    router r;
+    std::string hit;
+    for (auto p : {"/api/users", "/api/", "/api/user", "/apx", "/api/users/orders", "/b"}) {
+        std::string path(p);
+        r.add_route(path, [&hit, path](request::pointer) { hit = path; });
+    }
+
+    std::vector<std::pair<std::string, std::string>> expected = {{"/api/users", "/api/users"},
+                                                                 {"/api/usersx", "/api/users"},
+                                                                 {"/api/user", "/api/user"},
+                                                                 {"/api/use", "/api/"},
+                                                                 {"/api/users/orders/1", "/api/users/orders"},
+                                                                 {"/api/users/order", "/api/users"},
+                                                                 {"/apx/1", "/apx"},
+                                                                 {"/bb", "/b"}};
+    for (auto& e : expected) {
+        hit.clear();
+        find_and_exec(r, e.first);
+        BOOST_CHECK_MESSAGE(hit == e.second, e.first << " mapped to '" << hit << "' instead of " << e.second);
+    }
+
+    BOOST_CHECK(nullptr == r.find("/ap"));
+    BOOST_CHECK(nullptr == r.find(""));
+    BOOST_CHECK(nullptr != r.find("/api/"));
+}
+
+BOOST_AUTO_TEST_CASE(test_params) {
+    router r;
+    int hit = 0;
+    r.add_route("/users/:id/orders", [&hit](request::pointer) { hit = 1; });
+    r.add_route("/users/:id", [&hit](request::pointer) { hit = 2; });
+    r.add_route("/users/me", [&hit](request::pointer) { hit = 3; });
+    r.add_route("/items/:a/:b", [&hit](request::pointer) { hit = 4; }, "POST");
+
+    router::params_type params;
+    auto* f = r.find("/users/5/orders?limit=10", "GET", &params);
+    BOOST_REQUIRE(nullptr != f);
+    (*f)(nullptr);
+    BOOST_CHECK(hit == 1);
+    BOOST_REQUIRE(params.size() == 1);
+    BOOST_CHECK(params[0].first == "id" && params[0].second == "5");
+
+    params.clear();
+    f = r.find("/users/me", "GET", &params);
+    BOOST_REQUIRE(nullptr != f);
+    (*f)(nullptr);
+    BOOST_CHECK(hit == 3);
+    BOOST_CHECK(params.empty());
+
+    params.clear();
+    f = r.find("/items/x/y", "POST", &params);
+    BOOST_REQUIRE(nullptr != f);
+    (*f)(nullptr);
+    BOOST_CHECK(hit == 4);
+    BOOST_REQUIRE(params.size() == 2);
+    BOOST_CHECK(params[0].second == "x" && params[1].second == "y");
+
+    BOOST_CHECK(nullptr == r.find("/items/x/y", "GET"));
+    BOOST_CHECK(nullptr == r.find("/users/"));
+    BOOST_CHECK_THROW(r.add_route("/users/:uid/x", [](request::pointer) {}), std::runtime_error);
+}